@@ -0,0 +1,157 @@
+/*
+Copyright (c) 2018,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Contention between the viewer and the ingest on one RenderBuffer.
+// Viewer threads read rows the way the engine does while a writer
+// thread writes buckets, each side alone first and then both together.
+// Together they run twice, with the writer on the shared lock and the
+// per tile guards like fb_writer, and with the writer taking the lock
+// exclusively per bucket like the node did before.
+//
+// Usage: aton_bench_contention [readers] [seconds]
+
+#include "aton_framebuffer.h"
+#include <DDImage/Thread.h>
+#include <boost/atomic.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <cstdio>
+#include <cstdlib>
+
+// Only the node defines it
+std::string get_date() { return ""; }
+
+// An HD frame written in Arnold's default bucket size
+const int WIDTH = 1920;
+const int HEIGHT = 1080;
+const int BUCKET = 64;
+
+using namespace boost::posix_time;
+
+struct Bench
+{
+    Bench(): rb(0, WIDTH, HEIGHT), stop(false), rows(0), buckets(0),
+             row_wait(0), bucket_wait(0), exclusive(false)
+    {
+        rb.add_aov("RGBA", 4);
+        rb.set_ready(true);
+    }
+
+    RenderBuffer rb;
+    ReadWriteLock lock;
+    boost::atomic<bool> stop;
+    boost::atomic<long long> rows, buckets;
+
+    // Longest a row or a bucket took, in microseconds
+    Lock wait_lock;
+    long long row_wait, bucket_wait;
+
+    // Writer takes the lock exclusively per bucket
+    bool exclusive;
+};
+
+// Viewer thread, the lock is taken per row like the engine does
+static void reader(unsigned index, unsigned nthreads, void* data)
+{
+    Bench* bench = reinterpret_cast<Bench*>(data);
+    std::vector<float> row(WIDTH);
+
+    long long rows = 0, wait = 0;
+    int y = index % HEIGHT;
+    while (!bench->stop)
+    {
+        const ptime start = microsec_clock::universal_time();
+        {
+            ReadGuard lock(bench->lock);
+            for (int c = 0; c < 4; ++c)
+                bench->rb.read_row(0, y, 0, WIDTH, c, &row[0]);
+        }
+        wait = std::max<long long>(wait, (microsec_clock::universal_time() - start).total_microseconds());
+
+        y = (y + nthreads) % HEIGHT;
+        ++rows;
+    }
+    bench->rows += rows;
+
+    Guard guard(bench->wait_lock);
+    bench->row_wait = std::max(bench->row_wait, wait);
+}
+
+// Ingest thread, writes the frame bucket by bucket over and over
+static void writer(unsigned index, unsigned nthreads, void* data)
+{
+    Bench* bench = reinterpret_cast<Bench*>(data);
+    std::vector<float> pixels(BUCKET * BUCKET * 4, 0.5f);
+
+    long long buckets = 0, wait = 0;
+    int x = 0, y = 0;
+    while (!bench->stop)
+    {
+        const ptime start = microsec_clock::universal_time();
+        if (bench->exclusive)
+        {
+            WriteGuard lock(bench->lock);
+            bench->rb.write_bucket(0, x, y, BUCKET, BUCKET, 4, &pixels[0]);
+        }
+        else
+        {
+            ReadGuard lock(bench->lock);
+            bench->rb.write_bucket(0, x, y, BUCKET, BUCKET, 4, &pixels[0]);
+        }
+        wait = std::max<long long>(wait, (microsec_clock::universal_time() - start).total_microseconds());
+
+        x += BUCKET;
+        if (x >= WIDTH)
+        {
+            x = 0;
+            y = (y + BUCKET) % HEIGHT;
+        }
+        ++buckets;
+    }
+    bench->buckets += buckets;
+
+    Guard guard(bench->wait_lock);
+    bench->bucket_wait = std::max(bench->bucket_wait, wait);
+}
+
+// Run the readers and the writer for the given seconds, and print
+// their rates and the longest a row or a bucket had to wait
+static void run(const char* name,
+                const int& readers,
+                const bool& write,
+                const bool& exclusive,
+                const double& seconds)
+{
+    Bench bench;
+    bench.exclusive = exclusive;
+
+    if (readers > 0)
+        Thread::spawn(reader, readers, &bench);
+    if (write)
+        Thread::spawn(writer, 1, &bench);
+
+    sleepFor(seconds);
+    bench.stop = true;
+    Thread::wait(&bench);
+
+    printf("%-16s %10.0f rows/s %8lldus max %10.0f buckets/s %8lldus max\n", name,
+           bench.rows / seconds, bench.row_wait,
+           bench.buckets / seconds, bench.bucket_wait);
+}
+
+int main(int argc, char* argv[])
+{
+    const int readers = argc > 1 ? atoi(argv[1]) : 4;
+    const double seconds = argc > 2 ? atof(argv[2]) : 2.0;
+
+    printf("%dx%d, %d readers, %d pixel buckets, %gs per run\n",
+           WIDTH, HEIGHT, readers, BUCKET, seconds);
+
+    run("readers", readers, false, false, seconds);
+    run("writer", 0, true, false, seconds);
+    run("tile guards", readers, true, false, seconds);
+    run("exclusive lock", readers, true, true, seconds);
+    return 0;
+}
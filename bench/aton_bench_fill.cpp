@@ -0,0 +1,151 @@
+/*
+Copyright (c) 2018,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Fill rates of the row and the planar build of the node on one
+// RenderBuffer. The row path takes the lock per row and reads every
+// channel of it like engine does, the planar path takes it once per
+// stripe and reads channel by channel like renderStripe does, into
+// a plane of packed channels and into one of interleaved pixels.
+//
+// Usage: aton_bench_fill [threads] [seconds] [stripe rows]
+
+#include "aton_framebuffer.h"
+#include <DDImage/Thread.h>
+#include <boost/atomic.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+// Only the node defines it
+std::string get_date() { return ""; }
+
+// An HD frame, filled four channels at a time
+const int WIDTH = 1920;
+const int HEIGHT = 1080;
+const int CHANNELS = 4;
+
+enum FillMode { FILL_ROW = 0, FILL_PACKED, FILL_INTERLEAVED };
+
+struct Bench
+{
+    Bench(): rb(0, WIDTH, HEIGHT), stop(false), rows(0), mode(FILL_ROW), stripe(1)
+    {
+        rb.add_aov("RGBA", CHANNELS);
+        rb.set_ready(true);
+
+        std::vector<float> pixels(WIDTH * HEIGHT * CHANNELS, 0.5f);
+        rb.write_bucket(0, 0, 0, WIDTH, HEIGHT, CHANNELS, &pixels[0]);
+    }
+
+    RenderBuffer rb;
+    ReadWriteLock lock;
+    boost::atomic<bool> stop;
+    boost::atomic<long long> rows;
+
+    FillMode mode;
+    int stripe;
+};
+
+// Row path, the lock is taken per row and every channel read into
+// its own array like a Row holds them
+static void fill_row(Bench* bench, const int& y, std::vector<float>& out)
+{
+    ReadGuard lock(bench->lock);
+    for (int c = 0; c < CHANNELS; ++c)
+        bench->rb.read_row(0, y, 0, WIDTH, c, &out[c * WIDTH]);
+}
+
+// Planar path, the lock is taken once per stripe and it's filled
+// channel by channel. Interleaved planes are read through a row
+// and copied out with the stride of the plane.
+static void fill_stripe(Bench* bench,
+                        const int& y0,
+                        const int& y1,
+                        std::vector<float>& out,
+                        std::vector<float>& row)
+{
+    const bool packed = bench->mode == FILL_PACKED;
+    const int rows = y1 - y0;
+
+    ReadGuard lock(bench->lock);
+    for (int c = 0; c < CHANNELS; ++c)
+    {
+        for (int y = y0; y < y1; ++y)
+        {
+            if (packed)
+            {
+                float* dst = &out[(c * rows + y - y0) * WIDTH];
+                bench->rb.read_row(0, y, 0, WIDTH, c, dst);
+                continue;
+            }
+
+            float* dst = &out[(y - y0) * WIDTH * CHANNELS + c];
+            bench->rb.read_row(0, y, 0, WIDTH, c, &row[0]);
+            for (size_t i = 0; i < row.size(); ++i)
+                dst[i * CHANNELS] = row[i];
+        }
+    }
+}
+
+// Viewer thread, fills its share of the rows over and over
+static void filler(unsigned index, unsigned nthreads, void* data)
+{
+    Bench* bench = reinterpret_cast<Bench*>(data);
+    const int stripe = bench->mode == FILL_ROW ? 1 : bench->stripe;
+    std::vector<float> out(stripe * WIDTH * CHANNELS);
+    std::vector<float> row(WIDTH);
+
+    long long rows = 0;
+    int y = (index * stripe) % HEIGHT;
+    while (!bench->stop)
+    {
+        const int t = std::min(y + stripe, HEIGHT);
+        if (bench->mode == FILL_ROW)
+            fill_row(bench, y, out);
+        else
+            fill_stripe(bench, y, t, out, row);
+        rows += t - y;
+
+        y = (y + nthreads * stripe) % HEIGHT;
+    }
+    bench->rows += rows;
+}
+
+// Fill with the given threads for the given seconds, and print
+// the rate in rows and in frames
+static void run(const char* name,
+                const FillMode& mode,
+                const int& threads,
+                const int& stripe,
+                const double& seconds)
+{
+    Bench bench;
+    bench.mode = mode;
+    bench.stripe = stripe;
+
+    Thread::spawn(filler, threads, &bench);
+    sleepFor(seconds);
+    bench.stop = true;
+    Thread::wait(&bench);
+
+    printf("%-20s %10.0f rows/s %8.1f frames/s\n", name,
+           bench.rows / seconds, bench.rows / seconds / HEIGHT);
+}
+
+int main(int argc, char* argv[])
+{
+    const int threads = argc > 1 ? atoi(argv[1]) : 4;
+    const double seconds = argc > 2 ? atof(argv[2]) : 2.0;
+    const int stripe = argc > 3 ? atoi(argv[3]) : 64;
+
+    printf("%dx%d, %d channels, %d threads, %d row stripes, %gs per run\n",
+           WIDTH, HEIGHT, CHANNELS, threads, stripe, seconds);
+
+    run("row", FILL_ROW, threads, stripe, seconds);
+    run("planar packed", FILL_PACKED, threads, stripe, seconds);
+    run("planar interleaved", FILL_INTERLEAVED, threads, stripe, seconds);
+    return 0;
+}
@@ -0,0 +1,79 @@
+#==========
+#
+# Copyright (c) 2018, Dan Bethell, Johannes Saam, Vahan Sosoyan.
+# All rights reserved.
+#
+# For license information regarding redistribution and
+# use, please refer to the COPYING file.
+#
+#==========
+#
+# Variables defined by this module:
+#   OPENEXR_FOUND    (all caps)
+#   OpenEXR_INCLUDE_DIR
+#   OpenEXR_LIBRARIES
+#   OpenEXR_LIBRARY_DIR
+#
+# Usage: 
+#   FIND_PACKAGE( OpenEXR )
+#   FIND_PACKAGE( OpenEXR REQUIRED )
+#
+# Note:
+# You can tell the module where OpenEXR is installed by setting
+# the OpenEXR_INSTALL_PATH (or setting the OPENEXR_HOME environment
+# variable) before calling FIND_PACKAGE.
+# 
+# E.g. 
+#   SET( OpenEXR_INSTALL_PATH "/usr/local/openexr-2.2.0" )
+#   FIND_PACKAGE( OpenEXR REQUIRED )
+#
+#==========
+
+# our includes
+FIND_PATH( OpenEXR_INCLUDE_DIR OpenEXR/ImfMultiPartOutputFile.h
+  $ENV{OPENEXR_HOME}/include
+  ${OpenEXR_INSTALL_PATH}/include
+  /usr/include
+  /usr/local/include
+  )
+
+# our libraries
+FIND_LIBRARY( OpenEXR_IlmImf_LIBRARY IlmImf
+  $ENV{OPENEXR_HOME}/lib
+  ${OpenEXR_INSTALL_PATH}/lib
+  )
+
+FIND_LIBRARY( OpenEXR_Half_LIBRARY Half
+  $ENV{OPENEXR_HOME}/lib
+  ${OpenEXR_INSTALL_PATH}/lib
+  )
+
+FIND_LIBRARY( OpenEXR_Iex_LIBRARY Iex
+  $ENV{OPENEXR_HOME}/lib
+  ${OpenEXR_INSTALL_PATH}/lib
+  )
+
+FIND_LIBRARY( OpenEXR_IlmThread_LIBRARY IlmThread
+  $ENV{OPENEXR_HOME}/lib
+  ${OpenEXR_INSTALL_PATH}/lib
+  )
+
+SET( OpenEXR_LIBRARIES
+  ${OpenEXR_IlmImf_LIBRARY}
+  ${OpenEXR_IlmThread_LIBRARY}
+  ${OpenEXR_Iex_LIBRARY}
+  ${OpenEXR_Half_LIBRARY}
+  )
+
+# our library path
+GET_FILENAME_COMPONENT( OpenEXR_LIBRARY_DIR ${OpenEXR_IlmImf_LIBRARY} PATH )
+
+# did we find everything?
+INCLUDE( FindPackageHandleStandardArgs )
+FIND_PACKAGE_HANDLE_STANDARD_ARGS( OpenEXR DEFAULT_MSG
+  OpenEXR_INCLUDE_DIR
+  OpenEXR_IlmImf_LIBRARY
+  OpenEXR_Half_LIBRARY
+  OpenEXR_Iex_LIBRARY
+  OpenEXR_IlmThread_LIBRARY
+  )
@@ -0,0 +1,608 @@
+/*
+Copyright (c) 2018,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_cache.h"
+
+#include <set>
+#include <cstdio>
+#include <fstream>
+#include <boost/foreach.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+using namespace boost::filesystem;
+
+// File signature
+static const char MAGIC[8] = {'A', 'T', 'O', 'N', 'F', 'B', 'C', '3'};
+
+// Lists the cached FrameBuffers in order with their output names
+static const char* const INDEX_FILE = "index";
+
+// Finished frames paged out of memory, only kept while the node is open
+static const char* const PAGES_DIR = "pages";
+static const std::string PAGE_EXT = ".atp";
+
+template <typename T>
+static void put(std::vector<char>& out, const T& value)
+{
+    const char* ptr = reinterpret_cast<const char*>(&value);
+    out.insert(out.end(), ptr, ptr + sizeof(T));
+}
+
+// Status values are stored as the value they hold
+template <typename T>
+static void put(std::vector<char>& out, const StatusValue<T>& value)
+{
+    put(out, value.load());
+}
+
+static void put_str(std::vector<char>& out, const std::string& str)
+{
+    put(out, static_cast<int>(str.size()));
+    out.insert(out.end(), str.begin(), str.end());
+}
+
+template <typename T>
+static bool get(const char*& ptr, const char* end, T& value)
+{
+    if (end - ptr < static_cast<std::ptrdiff_t>(sizeof(T)))
+        return false;
+    memcpy(&value, ptr, sizeof(T));
+    ptr += sizeof(T);
+    return true;
+}
+
+template <typename T>
+static bool get(const char*& ptr, const char* end, StatusValue<T>& value)
+{
+    T v;
+    if (!get(ptr, end, v))
+        return false;
+    value.store(v);
+    return true;
+}
+
+static bool get_str(const char*& ptr, const char* end, std::string& str)
+{
+    int size;
+    if (!get(ptr, end, size) || size < 0 || end - ptr < size)
+        return false;
+    str.assign(ptr, size);
+    ptr += size;
+    return true;
+}
+
+// Samples per pixel of a buffer, from the planes it holds
+static int aov_spp(const bool& has_color, const bool& has_float)
+{
+    if (has_color && has_float)
+        return 4;
+    if (has_color)
+        return 3;
+    if (has_float)
+        return 1;
+    return 0;
+}
+
+
+std::string SessionCache::root()
+{
+    char* cache_path = getenv("ATON_CACHE_PATH");
+
+    std::string def_path = (temp_directory_path() / "aton_cache").string();
+
+    if (cache_path != NULL)
+        def_path = cache_path;
+
+    boost::replace_all(def_path, "\\", "/");
+
+    return def_path;
+}
+
+bool SessionCache::store(const std::string& dir, FrameBuffer& fb)
+{
+    // Snapshots never change once cached, live sessions might have
+    if (dir.empty() || fb.empty() ||
+        (!fb._cache_file.empty() && fb._session == 0))
+        return false;
+
+    try
+    {
+        create_directories(dir);
+
+        std::vector<const RenderBuffer*> rbs;
+        std::vector<RenderBuffer>::const_iterator it;
+        for(it = fb._renderbuffers.begin(); it != fb._renderbuffers.end(); ++it)
+            rbs.push_back(&*it);
+
+        const std::string file = unique_path("%%%%%%%%%%%%" + CACHE_EXT).string();
+        if (!write_file((path(dir) / file).string(), fb._frame, fb._output_name, rbs))
+            return false;
+        fb._cache_file = file;
+        return true;
+    }
+    catch (const filesystem_error& e)
+    {
+        std::cerr << "Aton: Could not save the session cache: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+void SessionCache::save_index(const std::string& dir,
+                              std::vector<FrameBuffer>& fbs)
+{
+    if (dir.empty())
+        return;
+
+    try
+    {
+        create_directories(dir);
+
+        std::set<std::string> keep;
+        std::string index;
+
+        std::vector<FrameBuffer>::iterator it;
+        for(it = fbs.begin(); it != fbs.end(); ++it)
+        {
+            if (it->empty() || it->_cache_file.empty())
+                continue;
+
+            keep.insert(it->_cache_file);
+            index += it->_cache_file + " " + it->_output_name + "\n";
+        }
+
+        const path index_path = path(dir) / INDEX_FILE;
+        const path index_tmp = path(dir) / (std::string(INDEX_FILE) + ".tmp");
+        {
+            std::ofstream out(index_tmp.string().c_str(), std::ios::binary);
+            out << index;
+        }
+        rename(index_tmp, index_path);
+
+        // Drop the files of removed or re-saved FrameBuffers
+        directory_iterator dit(dir);
+        BOOST_FOREACH(path const& p, std::make_pair(dit, directory_iterator()))
+        {
+            if (p.extension().string() == CACHE_EXT &&
+                keep.find(p.filename().string()) == keep.end())
+                remove(p);
+        }
+    }
+    catch (const filesystem_error& e)
+    {
+        std::cerr << "Aton: Could not save the session cache: " << e.what() << std::endl;
+    }
+}
+
+void SessionCache::save(const std::string& dir,
+                        std::vector<FrameBuffer>& fbs)
+{
+    std::vector<FrameBuffer>::iterator it;
+    for(it = fbs.begin(); it != fbs.end(); ++it)
+        store(dir, *it);
+
+    save_index(dir, fbs);
+}
+
+void SessionCache::load(const std::string& dir,
+                        std::vector<FrameBuffer>& fbs)
+{
+    if (dir.empty())
+        return;
+
+    std::ifstream in((path(dir) / INDEX_FILE).string().c_str());
+
+    std::string line;
+    while (std::getline(in, line))
+    {
+        const size_t split = line.find(' ');
+        if (split == std::string::npos)
+            continue;
+
+        const std::string file = line.substr(0, split);
+
+        FrameBuffer fb;
+        if (!read_file((path(dir) / file).string(), fb))
+        {
+            std::cerr << "Aton: Could not restore " << file << std::endl;
+            continue;
+        }
+
+        // Renamed snapshots only update the index
+        fb._output_name = line.substr(split + 1);
+        fb._cache_file = file;
+        fbs.push_back(fb);
+    }
+}
+
+bool SessionCache::write_file(const std::string& file_path,
+                              const double& frame,
+                              const std::string& output_name,
+                              const std::vector<const RenderBuffer*>& rbs)
+{
+    // Restored snapshots may not have been viewed yet,
+    // their planes are read through a mapping
+    std::vector<std::vector<AOVBuffer> > mapped(rbs.size());
+    for (size_t i = 0; i < rbs.size(); ++i)
+        if (rbs[i]->paged_out())
+            read_planes(*rbs[i], mapped[i]);
+
+    std::vector<char> header;
+    put(header, frame);
+    put_str(header, output_name);
+    put(header, static_cast<int>(rbs.size()));
+
+    // Planes follow the header back to back
+    long long offset = 0;
+
+    for (size_t i = 0; i < rbs.size(); ++i)
+    {
+        const RenderBuffer& rb = *rbs[i];
+        const std::vector<AOVBuffer>& buffers = rb.paged_out() ? mapped[i] : rb._buffers;
+
+        put(header, rb._frame);
+        put(header, rb._width);
+        put(header, rb._height);
+        put(header, rb._data_window.x());
+        put(header, rb._data_window.y());
+        put(header, rb._data_window.r());
+        put(header, rb._data_window.t());
+        put(header, rb._pix_aspect);
+        put(header, rb._ready);
+        put(header, rb._progress);
+        put(header, rb._time);
+        put(header, rb._ram);
+        put(header, rb._pram);
+        put(header, rb._fov);
+        for (int r = 0; r < 4; ++r)
+            for (int c = 0; c < 4; ++c)
+                put(header, rb._matrix[r][c]);
+        put(header, rb._version_int);
+        put_str(header, rb._name);
+        put_str(header, rb._version_str);
+        put_str(header, rb._samples_str);
+        put(header, static_cast<int>(buffers.size()));
+
+        for (size_t b = 0; b < buffers.size(); ++b)
+        {
+            const AOVBuffer& buffer = buffers[b];
+            const long long pixels = static_cast<long long>(buffer._width) * buffer._height;
+            const bool has_color = buffer.color_plane(0) != NULL;
+            const bool has_float = buffer.float_plane(0) != NULL;
+
+            put_str(header, rb._aovs[b]);
+            put(header, aov_spp(has_color, has_float));
+            put(header, offset);
+
+            offset += (has_color ? pixels * sizeof(RenderColor) : 0) +
+                      (has_float ? pixels * sizeof(float) : 0);
+        }
+    }
+
+    // Planes start aligned so they can be read in place once mapped
+    header.resize((header.size() + 15) / 16 * 16, 0);
+
+    // Written next to the target and moved over it once complete
+    const std::string tmp_path = file_path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (file == NULL)
+        return false;
+
+    const long long header_size = header.size();
+    bool ok = fwrite(MAGIC, 1, sizeof(MAGIC), file) == sizeof(MAGIC) &&
+              fwrite(&header_size, sizeof(header_size), 1, file) == 1 &&
+              fwrite(&header[0], 1, header.size(), file) == header.size();
+
+    for (size_t i = 0; ok && i < rbs.size(); ++i)
+    {
+        const std::vector<AOVBuffer>& buffers = rbs[i]->paged_out() ? mapped[i] : rbs[i]->_buffers;
+
+        std::vector<AOVBuffer>::const_iterator bit;
+        for(bit = buffers.begin(); ok && bit != buffers.end(); ++bit)
+        {
+            const size_t pixels = static_cast<size_t>(bit->_width) * bit->_height;
+            const RenderColor* color = bit->color_plane(0);
+            const float* floats = bit->float_plane(0);
+            if (color != NULL)
+                ok = fwrite(color, sizeof(RenderColor), pixels, file) == pixels;
+            if (ok && floats != NULL)
+                ok = fwrite(floats, sizeof(float), pixels, file) == pixels;
+        }
+    }
+
+    ok = fclose(file) == 0 && ok;
+
+    boost::system::error_code ec;
+    if (ok)
+        rename(tmp_path, file_path, ec);
+    if (!ok || ec)
+    {
+        remove(tmp_path, ec);
+        return false;
+    }
+    return true;
+}
+
+bool SessionCache::read_file(const std::string& file_path, FrameBuffer& fb)
+{
+    FILE* file = fopen(file_path.c_str(), "rb");
+    if (file == NULL)
+        return false;
+
+    // Only the header is read, planes are left for page_in
+    char magic[sizeof(MAGIC)];
+    long long header_size = 0;
+    std::vector<char> header;
+    bool ok = fread(magic, 1, sizeof(MAGIC), file) == sizeof(MAGIC) &&
+              memcmp(magic, MAGIC, sizeof(MAGIC)) == 0 &&
+              fread(&header_size, sizeof(header_size), 1, file) == 1 &&
+              header_size > 0;
+    if (ok)
+    {
+        header.resize(header_size);
+        ok = fread(&header[0], 1, header.size(), file) == header.size();
+    }
+    fclose(file);
+
+    if (!ok)
+        return false;
+
+    const long long data_start = sizeof(MAGIC) + sizeof(header_size) + header_size;
+    const char* ptr = &header[0];
+    const char* end = ptr + header.size();
+
+    int count;
+    if (!get(ptr, end, fb._frame) ||
+        !get_str(ptr, end, fb._output_name) ||
+        !get(ptr, end, count))
+        return false;
+
+    // Restored as snapshots, the sessions that made them are gone
+    fb._session = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        RenderBuffer rb;
+        float matrix[16];
+        int aovs, window[4];
+
+        ok = get(ptr, end, rb._frame) &&
+             get(ptr, end, rb._width) &&
+             get(ptr, end, rb._height) &&
+             get(ptr, end, window[0]) &&
+             get(ptr, end, window[1]) &&
+             get(ptr, end, window[2]) &&
+             get(ptr, end, window[3]) &&
+             window[2] >= window[0] && window[3] >= window[1] &&
+             get(ptr, end, rb._pix_aspect) &&
+             get(ptr, end, rb._ready) &&
+             get(ptr, end, rb._progress) &&
+             get(ptr, end, rb._time) &&
+             get(ptr, end, rb._ram) &&
+             get(ptr, end, rb._pram) &&
+             get(ptr, end, rb._fov);
+        for (int j = 0; ok && j < 16; ++j)
+            ok = get(ptr, end, matrix[j]);
+        ok = ok && get(ptr, end, rb._version_int) &&
+             get_str(ptr, end, rb._name) &&
+             get_str(ptr, end, rb._version_str) &&
+             get_str(ptr, end, rb._samples_str) &&
+             get(ptr, end, aovs) && aovs >= 0;
+        if (!ok)
+            return false;
+
+        rb._matrix = Matrix4(matrix);
+        rb._data_window.set(window[0], window[1], window[2], window[3]);
+        rb._cache_file = file_path;
+
+        for (int b = 0; b < aovs; ++b)
+        {
+            std::string name;
+            int spp;
+            long long offset;
+            if (!get_str(ptr, end, name) ||
+                !get(ptr, end, spp) ||
+                !get(ptr, end, offset))
+                return false;
+
+            rb._aovs.push_back(name);
+            rb._buffers.push_back(AOVBuffer());
+            rb._cache_spp.push_back(spp);
+            rb._cache_offsets.push_back(data_start + offset);
+        }
+
+        fb._frames.push_back(rb._frame);
+        fb._renderbuffers.push_back(rb);
+    }
+
+    return !fb._renderbuffers.empty();
+}
+
+bool SessionCache::page_in(RenderBuffer& rb)
+{
+    if (!rb.paged_out())
+        return true;
+
+    std::vector<AOVBuffer> buffers;
+    const bool ok = read_planes(rb, buffers);
+    adopt(rb, rb, buffers);
+    return ok;
+}
+
+bool SessionCache::read_planes(const RenderBuffer& rb,
+                               std::vector<AOVBuffer>& buffers)
+{
+    using namespace boost::interprocess;
+
+    const int width = rb._data_window.w();
+    const int height = rb._data_window.h();
+    const long long pixels = static_cast<long long>(width) * height;
+
+    buffers.clear();
+    bool ok = true;
+    try
+    {
+        // Only the mapping is set up here, pages are read
+        // from the file as the rows are first looked at
+        boost::shared_ptr<mapped_region> region;
+        {
+            file_mapping file(rb._cache_file.c_str(), read_only);
+            region.reset(new mapped_region(file, read_only));
+        }
+
+        const char* data = static_cast<const char*>(region->get_address());
+        const long long data_size = region->get_size();
+
+        for (size_t b = 0; ok && b < rb._cache_spp.size(); ++b)
+        {
+            const int& spp = rb._cache_spp[b];
+            const bool has_color = spp >= 3;
+            const bool has_float = spp == 1 || spp == 4;
+            const long long color_bytes = has_color ? pixels * sizeof(RenderColor) : 0;
+            const long long float_bytes = has_float ? pixels * sizeof(float) : 0;
+            const long long offset = rb._cache_offsets[b];
+
+            ok = offset >= 0 && offset % sizeof(float) == 0 &&
+                 offset + color_bytes + float_bytes <= data_size;
+            if (!ok)
+                break;
+
+            // No pyramid, building it would read the whole plane
+            AOVBuffer buffer(width, height);
+            buffer._levels.clear();
+            buffer._mapping = region;
+            if (has_color)
+                buffer._mapped_color = reinterpret_cast<const RenderColor*>(data + offset);
+            if (has_float)
+                buffer._mapped_float = reinterpret_cast<const float*>(data + offset + color_bytes);
+            buffers.push_back(buffer);
+        }
+    }
+    catch (const interprocess_exception&)
+    {
+        ok = false;
+    }
+
+    // A missing or short file leaves the RenderBuffer black
+    // rather than trying again on every redraw
+    if (!ok)
+    {
+        std::cerr << "Aton: Could not page in " << rb._cache_file << std::endl;
+
+        buffers.clear();
+        for (size_t b = 0; b < rb._cache_spp.size(); ++b)
+            buffers.push_back(AOVBuffer(width, height, rb._cache_spp[b]));
+    }
+
+    return ok;
+}
+
+bool SessionCache::adopt(RenderBuffer& rb,
+                         const RenderBuffer& source,
+                         std::vector<AOVBuffer>& buffers)
+{
+    // Someone else paged it in meanwhile
+    if (!rb.paged_out() || rb._cache_file != source._cache_file ||
+        rb._cache_offsets != source._cache_offsets)
+        return false;
+
+    rb._buffers.swap(buffers);
+    rb._cache_file.clear();
+    rb._cache_spp.clear();
+    rb._cache_offsets.clear();
+    return true;
+}
+
+void SessionCache::copy_in(RenderBuffer& rb)
+{
+    page_in(rb);
+
+    std::vector<AOVBuffer>::iterator it;
+    for(it = rb._buffers.begin(); it != rb._buffers.end(); ++it)
+    {
+        if (!it->_mapping)
+            continue;
+
+        const bool has_color = it->_mapped_color != NULL;
+        const bool has_float = it->_mapped_float != NULL;
+
+        AOVBuffer buffer(it->_width, it->_height, aov_spp(has_color, has_float));
+        if (has_color)
+            std::copy(it->_mapped_color,
+                      it->_mapped_color + buffer._color_data.size(),
+                      buffer._color_data.begin());
+        if (has_float)
+            std::copy(it->_mapped_float,
+                      it->_mapped_float + buffer._float_data.size(),
+                      buffer._float_data.begin());
+        buffer.build_levels();
+        *it = buffer;
+    }
+}
+
+bool SessionCache::page_out(const std::string& dir,
+                            const FrameBuffer& fb,
+                            const RenderBuffer& rb,
+                            std::vector<AOVBuffer>& buffers)
+{
+    if (dir.empty() || rb.paged_out() || rb.mapped())
+        return false;
+
+    try
+    {
+        // Cached snapshots are mapped from their own file
+        path file;
+        if (!fb._cache_file.empty() && fb._session == 0)
+            file = path(dir) / fb._cache_file;
+        else
+        {
+            const path pages = path(dir) / PAGES_DIR;
+            create_directories(pages);
+
+            file = pages / unique_path("%%%%%%%%%%%%" + PAGE_EXT);
+            if (!write_file(file.string(), fb._frame, fb._output_name,
+                            std::vector<const RenderBuffer*>(1, &rb)))
+                return false;
+        }
+
+        FrameBuffer paged;
+        if (!read_file(file.string(), paged))
+            return false;
+
+        std::vector<RenderBuffer>::const_iterator it;
+        for(it = paged._renderbuffers.begin(); it != paged._renderbuffers.end(); ++it)
+            if (it->_frame == rb._frame && it->_aovs == rb._aovs &&
+                !it->data_window_changed(rb._data_window))
+                return read_planes(*it, buffers);
+    }
+    catch (const filesystem_error& e)
+    {
+        std::cerr << "Aton: Could not page out: " << e.what() << std::endl;
+    }
+    return false;
+}
+
+bool SessionCache::release(RenderBuffer& rb,
+                           std::vector<AOVBuffer>& buffers)
+{
+    if (rb.paged_out() || rb.mapped() || buffers.size() != rb._buffers.size())
+        return false;
+
+    rb._buffers.swap(buffers);
+    return true;
+}
+
+void SessionCache::drop_pages(const std::string& dir)
+{
+    if (dir.empty())
+        return;
+
+    // Still mapped files are left for the next time
+    boost::system::error_code ec;
+    remove_all(path(dir) / PAGES_DIR, ec);
+}
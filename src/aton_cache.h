@@ -0,0 +1,79 @@
+/*
+Copyright (c) 2018,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_CACHE_H_
+#define ATON_CACHE_H_
+
+#include "aton_framebuffer.h"
+
+// Session cache file extension
+const std::string CACHE_EXT = ".atf";
+
+// Keeps the FrameBuffers of a node on disk so they survive a restart.
+// Every FrameBuffer is one file, a small header with the metadata
+// followed by the raw pixel planes. Loading only reads the headers,
+// the planes are mapped once a RenderBuffer is actually viewed and
+// read from the file as the rows are.
+class SessionCache
+{
+public:
+    // Directory all node caches live in
+    static std::string root();
+
+    // Write the file of a FrameBuffer not cached yet, the
+    // snapshots already in the cache are kept as they are
+    static bool store(const std::string& dir, FrameBuffer& fb);
+
+    // List the cached FrameBuffers in the index, in their order,
+    // and drop the files none of them refers to any more
+    static void save_index(const std::string& dir,
+                           std::vector<FrameBuffer>& fbs);
+
+    // Both of the above for all the FrameBuffers
+    static void save(const std::string& dir,
+                     std::vector<FrameBuffer>& fbs);
+
+    // Append the FrameBuffers saved in dir, pixels stay paged out
+    static void load(const std::string& dir,
+                     std::vector<FrameBuffer>& fbs);
+
+    // Map the file of a paged out RenderBuffer
+    static bool page_in(RenderBuffer& rb);
+
+    // Same in two steps, so the file can be mapped without holding
+    // the lock: map the planes through a copy of the paged out
+    // RenderBuffer, then hand them to rb if it still waits for them
+    static bool read_planes(const RenderBuffer& rb,
+                            std::vector<AOVBuffer>& buffers);
+    static bool adopt(RenderBuffer& rb,
+                      const RenderBuffer& source,
+                      std::vector<AOVBuffer>& buffers);
+
+    // Copy the mapped planes of rb into memory to write to them
+    static void copy_in(RenderBuffer& rb);
+
+    // Let the OS drop the planes of a finished RenderBuffer of fb from
+    // memory: write them to dir, unless fb is cached already, and map
+    // them into buffers, then swap those in for the planes of rb
+    static bool page_out(const std::string& dir,
+                         const FrameBuffer& fb,
+                         const RenderBuffer& rb,
+                         std::vector<AOVBuffer>& buffers);
+    static bool release(RenderBuffer& rb,
+                        std::vector<AOVBuffer>& buffers);
+
+    // Remove the paged out frames once nothing maps them
+    static void drop_pages(const std::string& dir);
+
+private:
+    static bool write_file(const std::string& path,
+                           const double& frame,
+                           const std::string& output_name,
+                           const std::vector<const RenderBuffer*>& rbs);
+    static bool read_file(const std::string& path, FrameBuffer& fb);
+};
+
+#endif // ATON_CACHE_H_
@@ -0,0 +1,363 @@
+/*
+Copyright (c) 2018,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_checkpoint.h"
+
+// File signature
+static const char MAGIC[8] = {'A', 'T', 'O', 'N', 'C', 'K', 'P', '2'};
+
+// Record tags
+const int CKP_HEADER = 0;
+const int CKP_BUCKET = 1;
+
+// Records are grouped in chunks of this size
+const size_t CHUNK_SIZE = 4 * 1048576;
+
+// The caller waits above this backlog rather than growing it unbounded
+const size_t MAX_PENDING = 512 * 1048576;
+
+template <typename T>
+static void put(std::vector<char>& out, const T& value)
+{
+    const char* ptr = reinterpret_cast<const char*>(&value);
+    out.insert(out.end(), ptr, ptr + sizeof(T));
+}
+
+static void put_str(std::vector<char>& out, const char* str)
+{
+    const int size = static_cast<int>(strlen(str));
+    put(out, size);
+    out.insert(out.end(), str, str + size);
+}
+
+template <typename T>
+static bool get(FILE* file, T& value)
+{
+    return fread(&value, sizeof(T), 1, file) == 1;
+}
+
+static bool get_str(FILE* file, std::string& str)
+{
+    int size;
+    if (!get(file, size) || size < 0)
+        return false;
+    str.resize(size);
+    return size == 0 || fread(&str[0], 1, size, file) == static_cast<size_t>(size);
+}
+
+
+CheckpointWriter::CheckpointWriter(): _running(false),
+                                      _quit(false),
+                                      _pending(0),
+                                      _waiting(false),
+                                      _full(false),
+                                      _file(NULL) {}
+
+CheckpointWriter::~CheckpointWriter() { stop(); }
+
+void CheckpointWriter::start()
+{
+    if (_running)
+        return;
+    
+    _quit = false;
+    _running = true;
+    Thread::spawn(io_thread, 1, this);
+}
+
+void CheckpointWriter::stop()
+{
+    if (!_running)
+        return;
+    
+    close();
+    
+    _signal.lock();
+    _quit = true;
+    _signal.signal();
+    _signal.unlock();
+    
+    Thread::wait(this);
+    _running = false;
+}
+
+void CheckpointWriter::open(const std::string& path)
+{
+    if (path == _path)
+        return;
+    
+    Chunk chunk;
+    chunk.path = path;
+    push(chunk);
+    _path = path;
+}
+
+void CheckpointWriter::close()
+{
+    if (_path.empty())
+        return;
+    
+    Chunk chunk;
+    chunk.close = true;
+    push(chunk);
+    _path.clear();
+}
+
+void CheckpointWriter::write_header(const DataHeader& dh)
+{
+    if (_path.empty())
+        return;
+    
+    // What the driver sent before is outdated, other drivers' regions
+    // go with it. Untagged drivers can't be told apart.
+    std::map<long long, int>& iterations = _iterations[_path];
+    std::map<long long, int>::iterator it = iterations.find(dh.source());
+    if (dh.source() != 0 && it != iterations.end() && it->second < dh.iteration())
+    {
+        Chunk chunk;
+        chunk.path = _path;
+        chunk.truncate = true;
+        push(chunk);
+        iterations.clear();
+    }
+    iterations[dh.source()] = dh.iteration();
+    
+    std::vector<char> record;
+    put(record, CKP_HEADER);
+    put(record, dh.session());
+    put(record, dh.xres());
+    put(record, dh.yres());
+    put(record, dh.pixel_aspect());
+    put(record, dh.frame());
+    put_str(record, dh.output_name());
+    append(record, NULL, 0);
+}
+
+void CheckpointWriter::write_bucket(const DataPixels& dp, const float& frame)
+{
+    if (_path.empty())
+        return;
+    
+    std::vector<char> record;
+    put(record, CKP_BUCKET);
+    put(record, frame);
+    put(record, dp.bucket_xo());
+    put(record, dp.bucket_yo());
+    put(record, dp.bucket_size_x());
+    put(record, dp.bucket_size_y());
+    put(record, dp.spp());
+    put_str(record, dp.aov_name());
+    
+    const int samples = dp.bucket_size_x() * dp.bucket_size_y() * dp.spp();
+    const char* pixels = reinterpret_cast<const char*>(&dp.pixel());
+    append(record, pixels, samples * sizeof(float));
+}
+
+void CheckpointWriter::append(const std::vector<char>& record,
+                              const char* data,
+                              const size_t& data_size)
+{
+    const size_t size = record.size() + data_size;
+    
+    _signal.lock();
+    
+    // A record lost would restore as a frame that looks complete,
+    // so wait for the I/O thread to take the backlog instead
+    while (_pending > 0 && _pending + size > MAX_PENDING)
+    {
+        _full = true;
+        _signal.wait();
+        _full = false;
+    }
+    
+    // Add to the last block of records while it has room
+    if (_chunks.empty() || !_chunks.back().path.empty() ||
+        _chunks.back().close || _chunks.back().data.size() >= CHUNK_SIZE)
+        _chunks.push_back(Chunk());
+    
+    std::vector<char>& block = _chunks.back().data;
+    block.insert(block.end(), record.begin(), record.end());
+    block.insert(block.end(), data, data + data_size);
+    _pending += size;
+    
+    if (_waiting)
+        _signal.signal();
+    _signal.unlock();
+}
+
+void CheckpointWriter::push(const Chunk& chunk)
+{
+    _signal.lock();
+    _chunks.push_back(chunk);
+    if (_waiting)
+        _signal.signal();
+    _signal.unlock();
+}
+
+void CheckpointWriter::io_thread(unsigned index, unsigned nthreads, void* data)
+{
+    CheckpointWriter* writer = reinterpret_cast<CheckpointWriter*>(data);
+    std::deque<Chunk> chunks;
+    
+    while (true)
+    {
+        // Take everything queued since the last pass
+        writer->_signal.lock();
+        while (writer->_chunks.empty() && !writer->_quit)
+        {
+            writer->_waiting = true;
+            writer->_signal.wait();
+            writer->_waiting = false;
+        }
+        if (writer->_chunks.empty())
+        {
+            writer->_signal.unlock();
+            break;
+        }
+        chunks.swap(writer->_chunks);
+        writer->_pending = 0;
+        if (writer->_full)
+            writer->_signal.signal();
+        writer->_signal.unlock();
+        
+        FILE*& file = writer->_file;
+        std::deque<Chunk>::iterator it;
+        for(it = chunks.begin(); it != chunks.end(); ++it)
+        {
+            if (!it->path.empty())
+            {
+                if (file != NULL)
+                    fclose(file);
+                
+                file = fopen(it->path.c_str(), it->truncate ? "wb" : "ab");
+                if (file == NULL)
+                    std::cerr << "Aton: Could not open checkpoint " << it->path << std::endl;
+                else if (fseek(file, 0, SEEK_END) == 0 && ftell(file) == 0)
+                    fwrite(MAGIC, 1, sizeof(MAGIC), file);
+            }
+            else if (it->close)
+            {
+                if (file != NULL)
+                    fclose(file);
+                file = NULL;
+            }
+            else if (file != NULL)
+                fwrite(&it->data[0], 1, it->data.size(), file);
+        }
+        
+        // Keep what we have recoverable
+        if (file != NULL)
+            fflush(file);
+        
+        chunks.clear();
+    }
+    
+    if (writer->_file != NULL)
+    {
+        fclose(writer->_file);
+        writer->_file = NULL;
+    }
+}
+
+bool read_checkpoint(const std::string& path, FrameBuffer& fb)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == NULL)
+        return false;
+    
+    char magic[sizeof(MAGIC)];
+    if (fread(magic, 1, sizeof(MAGIC), file) != sizeof(MAGIC) ||
+        memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+    {
+        fclose(file);
+        return false;
+    }
+    
+    std::string name;
+    std::vector<float> pixels;
+    
+    // Area and rendered area of every frame for the progress
+    std::map<double, std::pair<long long, long long> > progress;
+    
+    int tag;
+    while (get(file, tag))
+    {
+        if (tag == CKP_HEADER)
+        {
+            long long session;
+            int xres, yres;
+            float aspect, frame;
+            if (!get(file, session) || !get(file, xres) || !get(file, yres) ||
+                !get(file, aspect) || !get(file, frame) || !get_str(file, name))
+                break;
+            
+            if (!fb.renderbuffer_exists(frame))
+            {
+                DataHeader dh(session, xres, yres, aspect, 0, 0, frame,
+                              0.0f, NULL, NULL, name.c_str());
+                RenderBuffer* rb = fb.add_renderbuffer(&dh);
+                
+                // Later frames start out as a copy of the last one
+                rb->clear_all();
+                rb->clear_flipbook();
+                rb->set_resolution(xres, yres);
+                rb->set_frame(frame);
+                rb->set_name(name);
+            }
+            else
+            {
+                RenderBuffer* rb = fb.get_renderbuffer(frame);
+                if (rb->resolution_changed(xres, yres))
+                    rb->set_resolution(xres, yres);
+            }
+            
+            // Progress restarts with every iteration
+            progress[frame] = std::make_pair(static_cast<long long>(xres) * yres, 0LL);
+        }
+        else if (tag == CKP_BUCKET)
+        {
+            float frame;
+            int x, y, w, h, spp;
+            if (!get(file, frame) || !get(file, x) || !get(file, y) || !get(file, w) ||
+                !get(file, h) || !get(file, spp) || !get_str(file, name))
+                break;
+            
+            pixels.resize(w * h * spp);
+            if (fread(&pixels[0], sizeof(float), pixels.size(), file) != pixels.size())
+                break;
+            
+            // Its header never made it to the file
+            if (!fb.renderbuffer_exists(frame))
+                continue;
+            
+            RenderBuffer* rb = fb.get_renderbuffer(frame);
+            if (!rb->aov_exists(name.c_str()))
+                rb->add_aov(name.c_str(), spp);
+            rb->write_bucket(rb->get_aov_index(name.c_str()), x, y, w, h, spp, &pixels[0]);
+            
+            if (rb->first_aov_name(name.c_str()))
+                progress[frame].second += w * h;
+        }
+        else
+            break;
+    }
+    fclose(file);
+    
+    bool restored = false;
+    std::map<double, std::pair<long long, long long> >::iterator it;
+    for(it = progress.begin(); it != progress.end(); ++it)
+    {
+        RenderBuffer* rb = fb.get_renderbuffer(it->first);
+        if (rb->empty())
+            continue;
+        
+        if (it->second.first > 0)
+            rb->set_progress(it->second.second * 100 / it->second.first);
+        rb->set_ready(true);
+        restored = true;
+    }
+    return restored;
+}
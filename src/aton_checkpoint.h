@@ -0,0 +1,93 @@
+/*
+Copyright (c) 2018,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_CHECKPOINT_H_
+#define ATON_CHECKPOINT_H_
+
+#include <map>
+#include <deque>
+#include <cstdio>
+#include <DDImage/Thread.h>
+#include <boost/atomic.hpp>
+#include "aton_framebuffer.h"
+
+using namespace DD::Image;
+
+// Checkpoint file extension
+const std::string CHECKPOINT_EXT = ".atc";
+
+// Appends incoming headers and buckets to an on disk checkpoint.
+// Records are only copied to memory by the caller, a background
+// thread writes them out in batches, sequentially, so a slow
+// disk only holds up the ingest once MAX_PENDING is queued.
+class CheckpointWriter
+{
+public:
+    CheckpointWriter();
+    ~CheckpointWriter();
+    
+    // Spawn and join the I/O thread
+    void start();
+    void stop();
+    
+    // Following records are appended to the given file
+    void open(const std::string& path);
+    
+    // Append a record, a new iteration of a driver that
+    // sent to the file before starts the file over
+    void write_header(const DataHeader& dh);
+    void write_bucket(const DataPixels& dp, const float& frame);
+    
+    // Flush and close the current file
+    void close();
+    
+    // Path of the open file, empty if none
+    const std::string& path() const { return _path; }
+    
+private:
+    // One file switch, truncation, close or block of records
+    struct Chunk
+    {
+        Chunk(): close(false), truncate(false) {}
+        std::string path;
+        bool close, truncate;
+        std::vector<char> data;
+    };
+    
+    static void io_thread(unsigned index, unsigned nthreads, void* data);
+    
+    // Queue a chunk and wake the I/O thread if it sleeps
+    void push(const Chunk& chunk);
+    
+    // Copy a record and its optional payload to the last chunk
+    void append(const std::vector<char>& record,
+                const char* data,
+                const size_t& data_size);
+    
+    bool _running;
+    bool _quit;
+    std::string _path;
+    
+    // Chunks waiting for the I/O thread, guarded by _signal,
+    // and whether the caller waits for the backlog to clear
+    std::deque<Chunk> _chunks;
+    size_t _pending;
+    SignalLock _signal;
+    boost::atomic<bool> _waiting;
+    bool _full;
+    
+    // Latest iteration of every driver per file it sent a header to
+    std::map<std::string, std::map<long long, int> > _iterations;
+    
+    // Only used by the I/O thread
+    FILE* _file;
+};
+
+// Replay a checkpoint file into the FrameBuffer, every frame into
+// a RenderBuffer of its own. A truncated last record is ignored.
+bool read_checkpoint(const std::string& path, FrameBuffer& fb);
+
+#endif // ATON_CHECKPOINT_H_
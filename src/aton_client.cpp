@@ -5,6 +5,8 @@ All rights reserved. See COPYING.txt for more details.
 */
 
 #include "aton_client.h"
+#include <cmath>
+#include <algorithm>
 #include <boost/lexical_cast.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
@@ -55,6 +57,22 @@ const int pack_4_int(int a, int b, int c, int d)
     return a * 1000000 + b * 10000 + c * 100 + d;
 }
 
+const unsigned char encode_preview(const float& value)
+{
+    // Reinhard, then a square root to spend the codes on the darks
+    const float v = value > 0.0f ? value : 0.0f;
+    const float t = std::sqrt(v / (1.0f + v));
+    return static_cast<unsigned char>(std::min(t * 255.0f + 0.5f, 255.0f));
+}
+
+const float decode_preview(const unsigned char& code)
+{
+    // The top code covers everything brighter, its lower edge is used
+    const float t = std::min(static_cast<float>(code), 254.5f) / 255.0f;
+    const float s = t * t;
+    return s / (1.0f - s);
+}
+
 // Data Class
 DataHeader::DataHeader(const long long& index,
                        const int& xres,
@@ -66,7 +84,10 @@ DataHeader::DataHeader(const long long& index,
                        const float& cam_fov,
                        const float* cam_matrix,
                        const int* samples,
-                       const char* output_name): mSession(index),
+                       const char* output_name,
+                       const int* data_window,
+                       const long long& source,
+                       const int& iteration): mSession(index),
                                                  mXres(xres),
                                                  mYres(yres),
                                                  mPixAspectRatio(pix_aspect),
@@ -74,6 +95,8 @@ DataHeader::DataHeader(const long long& index,
                                                  mVersion(version),
                                                  mFrame(frame),
                                                  mCamFov(cam_fov),
+                                                 mSource(source),
+                                                 mIteration(iteration),
                                                  mOutputName(output_name)
 {
     if (cam_matrix != NULL)
@@ -81,6 +104,16 @@ DataHeader::DataHeader(const long long& index,
     
     if (samples != NULL)
         mSamples = const_cast<int*>(samples);
+    
+    if (data_window != NULL)
+        memcpy(mDataWindow, data_window, sizeof(int) * 4);
+    else
+    {
+        mDataWindow[0] = 0;
+        mDataWindow[1] = 0;
+        mDataWindow[2] = xres - 1;
+        mDataWindow[3] = yres - 1;
+    }
 }
 
 DataHeader::~DataHeader() {}
@@ -98,8 +131,6 @@ DataPixels::DataPixels(const int& xres,
                        const int& bucket_size_x,
                        const int& bucket_size_y,
                        const int& spp,
-                       const long long& ram,
-                       const int& time,
                        const char* aovName,
                        const float* data) : mXres(xres),
                                             mYres(yres),
@@ -108,10 +139,10 @@ DataPixels::DataPixels(const int& xres,
                                             mBucket_size_x(bucket_size_x),
                                             mBucket_size_y(bucket_size_y),
                                             mSpp(spp),
-                                            mRam(ram),
-                                            mTime(time),
-                                            mAovName(aovName)
-
+                                            mAovName(aovName),
+                                            mPreview(false),
+                                            mScale(1),
+                                            mIteration(0)
 {
     if (data != NULL)
         mpData = const_cast<float*>(data);
@@ -126,13 +157,78 @@ void DataPixels::free()
 }
 
 
+// Render Stats Class
+RenderStats::RenderStats(const long long& ram,
+                         const long long& peak_ram,
+                         const unsigned int& time,
+                         const int& buckets): mRam(ram),
+                                              mPeakRam(peak_ram),
+                                              mTime(time),
+                                              mBuckets(buckets),
+                                              mIteration(0) {}
+
+
+// View Region Class
+ViewRegion::ViewRegion(const int& min_x,
+                       const int& min_y,
+                       const int& max_x,
+                       const int& max_y,
+                       const float& zoom): mMinX(min_x),
+                                           mMinY(min_y),
+                                           mMaxX(max_x),
+                                           mMaxY(max_y),
+                                           mZoom(zoom) {}
+
+bool ViewRegion::intersects(const int& x,
+                            const int& y,
+                            const int& width,
+                            const int& height) const
+{
+    return !empty() && x <= mMaxX && x + width > mMinX &&
+                       y <= mMaxY && y + height > mMinY;
+}
+
+bool ViewRegion::operator==(const ViewRegion& other) const
+{
+    return mMinX == other.mMinX && mMinY == other.mMinY &&
+           mMaxX == other.mMaxX && mMaxY == other.mMaxY &&
+           mZoom == other.mZoom;
+}
+
+// AOV Subscription Class
+void AovSubscription::add_viewed(const std::string& aov)
+{
+    if (std::find(mViewed.begin(), mViewed.end(), aov) == mViewed.end())
+        mViewed.push_back(aov);
+}
+
+bool AovSubscription::wants(const char* aov, const bool& beauty) const
+{
+    return beauty || mAll || viewed(aov);
+}
+
+bool AovSubscription::viewed(const char* aov) const
+{
+    return std::find(mViewed.begin(), mViewed.end(), aov) != mViewed.end();
+}
+
+bool AovSubscription::operator==(const AovSubscription& other) const
+{
+    return mAll == other.mAll && mViewed == other.mViewed;
+}
+
 
 // Client Class
 Client::Client(std::string hostname, int port): mHost(hostname),
                                                 mPort(port),
                                                 mImageId(-1),
+                                                mStream(0),
+                                                mSentStream(-1),
+                                                mMultiplexed(false),
                                                 mSocket(mIoService),
-                                                mIsConnected(false) {}
+                                                mIsConnected(false),
+                                                mPaused(false),
+                                                mAbort(false) {}
 
 Client::~Client()
 {
@@ -154,24 +250,51 @@ void Client::connect()
     }
     if (error)
         throw boost::system::system_error(error);
+    
+    // A new connection knows of no stream yet
+    mSentStream = -1;
 }
 
 void Client::disconnect()
 {
     mSocket.close();
+    mIsConnected = false;
+}
+
+void Client::set_stream(const int& stream)
+{
+    mStream = stream;
+    mMultiplexed = true;
+}
+
+void Client::send_stream()
+{
+    if (!mMultiplexed || mSentStream == mStream)
+        return;
+    
+    int key = 8;
+    write(mSocket, buffer(reinterpret_cast<char*>(&key), sizeof(int)));
+    write(mSocket, buffer(reinterpret_cast<char*>(&mStream), sizeof(int)));
+    mSentStream = mStream;
 }
 
 void Client::open_image(DataHeader& header)
 {
-    // Connect to port!
-    connect();
+    // Connect to port, the streams share the connection
+    if (!mMultiplexed || !mIsConnected)
+        connect();
+    send_stream();
 
     // Send image header message with image desc information
     int key = 0;
     write(mSocket, buffer(reinterpret_cast<char*>(&key), sizeof(int)));
     
-    // Read our imageid
-    read(mSocket, buffer(reinterpret_cast<char*>(&mImageId), sizeof(int)));
+    // Read our imageid, the streams don't wait for it since
+    // the Server may be writing other messages back meanwhile
+    if (mMultiplexed)
+        mImageId = 1;
+    else
+        read(mSocket, buffer(reinterpret_cast<char*>(&mImageId), sizeof(int)));
     
     // Send our width & height
     write(mSocket, buffer(reinterpret_cast<char*>(&header.mSession), sizeof(long long)));
@@ -189,6 +312,14 @@ void Client::open_image(DataHeader& header)
     const int samplesSize = 6;
     write(mSocket, buffer(reinterpret_cast<char*>(&header.mSamples[0]), sizeof(int)*samplesSize));
     
+    const int dataWindowSize = 4;
+    write(mSocket, buffer(reinterpret_cast<char*>(&header.mDataWindow[0]), sizeof(int)*dataWindowSize));
+    
+    // Every message of the image is tagged with its iteration
+    write(mSocket, buffer(reinterpret_cast<char*>(&header.mSource), sizeof(long long)));
+    write(mSocket, buffer(reinterpret_cast<char*>(&header.mIteration), sizeof(int)));
+    mIterations[mStream] = header.mIteration;
+    
     // Get size of aov name
     size_t output_size = strlen(header.mOutputName) + 1;
     write(mSocket, buffer(reinterpret_cast<char*>(&output_size), sizeof(size_t)));
@@ -196,7 +327,7 @@ void Client::open_image(DataHeader& header)
     mIsConnected = true;
 }
 
-void Client::send_pixels(DataPixels& pixels)
+void Client::send_pixels_info(const int& key, DataPixels& pixels)
 {
     if (mImageId < 0)
     {
@@ -204,16 +335,13 @@ void Client::send_pixels(DataPixels& pixels)
     }
 
     // Send data for image_id
-    int key = 1;
-    
-    write(mSocket, buffer(reinterpret_cast<char*>(&key), sizeof(int)));
+    send_stream();
+    write(mSocket, buffer(reinterpret_cast<const char*>(&key), sizeof(int)));
     write(mSocket, buffer(reinterpret_cast<char*>(&mImageId), sizeof(int)));
+    write(mSocket, buffer(reinterpret_cast<char*>(&mIterations[mStream]), sizeof(int)));
 
     // Get size of aov name
     size_t aov_size = strlen(pixels.mAovName) + 1;
-
-    // Get size of overall samples
-    const int num_samples = pixels.mBucket_size_x * pixels.mBucket_size_y * pixels.mSpp;
     
     // Sending data to buffer
     write(mSocket, buffer(reinterpret_cast<char*>(&pixels.mXres), sizeof(int)));
@@ -223,18 +351,95 @@ void Client::send_pixels(DataPixels& pixels)
     write(mSocket, buffer(reinterpret_cast<char*>(&pixels.mBucket_size_x), sizeof(int)));
     write(mSocket, buffer(reinterpret_cast<char*>(&pixels.mBucket_size_y), sizeof(int)));
     write(mSocket, buffer(reinterpret_cast<char*>(&pixels.mSpp), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&pixels.mRam), sizeof(long long)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&pixels.mTime), sizeof(int)));
     write(mSocket, buffer(reinterpret_cast<char*>(&aov_size), sizeof(size_t)));
     write(mSocket, buffer(pixels.mAovName, aov_size));
-    write(mSocket, buffer(reinterpret_cast<char*>(&pixels.mpData[0]), sizeof(float)*num_samples));
+}
+
+void Client::send_pixels(DataPixels& pixels, const int& scale)
+{
+    const int& width = pixels.mBucket_size_x;
+    const int& height = pixels.mBucket_size_y;
+    const int& spp = pixels.mSpp;
+    
+    if (scale <= 1)
+    {
+        send_pixels_info(1, pixels);
+        
+        // Get size of overall samples
+        const int num_samples = width * height * spp;
+        write(mSocket, buffer(reinterpret_cast<char*>(&pixels.mpData[0]), sizeof(float)*num_samples));
+        return;
+    }
+    
+    // Average every scale x scale block, the ones on
+    // the right and bottom edges may be partial
+    const int w = (width + scale - 1) / scale;
+    const int h = (height + scale - 1) / scale;
+    std::vector<float> reduced(w * h * spp, 0.0f);
+    for (int y = 0; y < height; ++y)
+    {
+        const float* src = pixels.mpData + y * width * spp;
+        float* dst = &reduced[(y / scale) * w * spp];
+        for (int x = 0; x < width; ++x)
+            for (int c = 0; c < spp; ++c)
+                dst[(x / scale) * spp + c] += *src++;
+    }
+    for (int y = 0; y < h; ++y)
+    {
+        const int rows = std::min(scale, height - y * scale);
+        for (int x = 0; x < w; ++x)
+        {
+            const float weight = 1.0f / (rows * std::min(scale, width - x * scale));
+            for (int c = 0; c < spp; ++c)
+                reduced[(y * w + x) * spp + c] *= weight;
+        }
+    }
+    
+    send_pixels_info(6, pixels);
+    write(mSocket, buffer(reinterpret_cast<const char*>(&scale), sizeof(int)));
+    write(mSocket, buffer(reduced));
+}
+
+void Client::send_preview(DataPixels& pixels)
+{
+    send_pixels_info(5, pixels);
+    
+    const int num_samples = pixels.mBucket_size_x * pixels.mBucket_size_y * pixels.mSpp;
+    std::vector<unsigned char> codes(num_samples);
+    for (int i = 0; i < num_samples; ++i)
+        codes[i] = encode_preview(pixels.mpData[i]);
+    write(mSocket, buffer(codes));
+}
+
+void Client::send_stats(RenderStats& stats)
+{
+    if (mImageId < 0)
+    {
+        throw std::runtime_error("Could not send stats - image id is not valid!");
+    }
+    
+    send_stream();
+    int key = 10;
+    write(mSocket, buffer(reinterpret_cast<char*>(&key), sizeof(int)));
+    write(mSocket, buffer(reinterpret_cast<char*>(&mImageId), sizeof(int)));
+    write(mSocket, buffer(reinterpret_cast<char*>(&mIterations[mStream]), sizeof(int)));
+    write(mSocket, buffer(reinterpret_cast<char*>(&stats.mRam), sizeof(long long)));
+    write(mSocket, buffer(reinterpret_cast<char*>(&stats.mPeakRam), sizeof(long long)));
+    write(mSocket, buffer(reinterpret_cast<char*>(&stats.mTime), sizeof(int)));
+    write(mSocket, buffer(reinterpret_cast<char*>(&stats.mBuckets), sizeof(int)));
 }
 
 void Client::close_image()
 {
     // Send image complete message for image_id
+    send_stream();
     int key = 2;
     write(mSocket, buffer(reinterpret_cast<char*>(&key), sizeof(int)));
+    
+    // The other streams keep the connection open
+    mIterations.erase(mStream);
+    if (mMultiplexed)
+        return;
 
     // Tell the server which image we're closing
     write(mSocket, buffer(reinterpret_cast<char*>(&mImageId), sizeof(int)));
@@ -243,6 +448,73 @@ void Client::close_image()
     disconnect();
 }
 
+bool Client::poll()
+{
+    bool changed = false;
+    boost::system::error_code ec;
+    while (mIsConnected && mSocket.available(ec) >= sizeof(int) && !ec)
+    {
+        int key;
+        read(mSocket, buffer(reinterpret_cast<char*>(&key), sizeof(int)));
+        
+        switch (key)
+        {
+            case 3: // Region the viewer is looking at
+            {
+                ViewRegion region;
+                read(mSocket, buffer(reinterpret_cast<char*>(&region.mMinX), sizeof(int)));
+                read(mSocket, buffer(reinterpret_cast<char*>(&region.mMinY), sizeof(int)));
+                read(mSocket, buffer(reinterpret_cast<char*>(&region.mMaxX), sizeof(int)));
+                read(mSocket, buffer(reinterpret_cast<char*>(&region.mMaxY), sizeof(int)));
+                read(mSocket, buffer(reinterpret_cast<char*>(&region.mZoom), sizeof(float)));
+                changed = changed || region != mViewRegion;
+                mViewRegion = region;
+                break;
+            }
+            case 4: // AOVs the node wants
+            {
+                AovSubscription subscription;
+                int all, count;
+                read(mSocket, buffer(reinterpret_cast<char*>(&all), sizeof(int)));
+                read(mSocket, buffer(reinterpret_cast<char*>(&count), sizeof(int)));
+                subscription.mAll = all != 0;
+                for (int i = 0; i < count; ++i)
+                {
+                    size_t aov_size;
+                    read(mSocket, buffer(reinterpret_cast<char*>(&aov_size), sizeof(size_t)));
+                    std::vector<char> aov(aov_size + 1, 0);
+                    read(mSocket, buffer(&aov[0], aov_size));
+                    subscription.mViewed.push_back(&aov[0]);
+                }
+                changed = changed || subscription != mSubscription;
+                mSubscription = subscription;
+                break;
+            }
+            case 7: // Pause, resume or abort the render
+            {
+                int control;
+                read(mSocket, buffer(reinterpret_cast<char*>(&control), sizeof(int)));
+                if (control == RENDER_ABORT)
+                    mAbort = true;
+                else
+                    mPaused = control == RENDER_PAUSE;
+                changed = true;
+                break;
+            }
+            default:
+                throw std::runtime_error("Unknown message from the server!");
+        }
+    }
+    return changed;
+}
+
+bool Client::take_abort()
+{
+    const bool abort = mAbort;
+    mAbort = false;
+    return abort;
+}
+
 void Client::quit()
 {
     connect();
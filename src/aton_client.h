@@ -7,6 +7,7 @@ All rights reserved. See COPYING.txt for more details.
 #ifndef ATON_CLIENT_H_
 #define ATON_CLIENT_H_
 
+#include <map>
 #include <vector>
 #include <boost/asio.hpp>
 
@@ -20,6 +21,12 @@ const long long get_unique_id();
 
 const int pack_4_int(int a, int b, int c, int d);
 
+// 8 bit code of a preview sample and back, tone mapped
+// so the highlights keep some of their range
+const unsigned char encode_preview(const float& value);
+
+const float decode_preview(const unsigned char& code);
+
 
 class Client;
 
@@ -27,6 +34,7 @@ class DataHeader
 {
     friend class Client;
     friend class Server;
+    friend class Connection;
     
 public:
     
@@ -40,7 +48,10 @@ public:
                const float& cam_fov = 0.0f,
                const float* cam_matrix = NULL,
                const int* samples = NULL,
-               const char* outputName = NULL);
+               const char* outputName = NULL,
+               const int* data_window = NULL,
+               const long long& source = 0,
+               const int& iteration = 0);
     
     ~DataHeader();
     
@@ -75,6 +86,15 @@ public:
     
     const char* output_name() const { return mOutputName; }
     
+    // Pixels being rendered, min x, min y, max x, max y inclusive,
+    // in the coordinates of the buckets. The whole frame by default.
+    const int* data_window() const { return mDataWindow; }
+    
+    // Driver sending the image, and the count of images it opened
+    // before. A newer iteration of a frame outdates the older ones.
+    const long long& source() const { return mSource; }
+    const int& iteration() const { return mIteration; }
+    
     // Deallocate output name
     void free();
 
@@ -107,6 +127,13 @@ private:
     int* mSamples;
     std::vector<int> mSamplesStore;
     
+    // Data window
+    int mDataWindow[4];
+    
+    // Sending driver and its iteration
+    long long mSource;
+    int mIteration;
+    
     // Outout name
     const char *mOutputName;
 
@@ -116,6 +143,7 @@ class DataPixels
 {
     friend class Client;
     friend class Server;
+    friend class Connection;
     
 public:
     DataPixels(const int& xres = 0,
@@ -125,8 +153,6 @@ public:
                const int& bucket_size_x = 0,
                const int& bucket_size_y = 0,
                const int& spp = 0,
-               const long long& ram = 0,
-               const int& time = 0,
                const char* aovName = NULL,
                const float* data = NULL);
     
@@ -153,20 +179,24 @@ public:
     // Samples-per-pixel, aka channel depth
     const int& spp() const { return mSpp; }
     
-    // Taken memory while rendering
-    const long long& ram() const { return mRam; }
-    
-    // Taken time while rendering
-    const unsigned int& time() const { return mTime; }
-    
     // Get Aov name
     const char* aov_name() const { return mAovName; }
     
     // Pointer to pixel data owned by the display driver (client-side)
     const float* data() const { return mpData; }
     
+    // Approximate pixels, the exact ones follow later. Either an 8 bit
+    // preview or a bucket sent at a fraction of its resolution.
+    const bool& preview() const { return mPreview; }
+    
+    // Pixels of the bucket each sent sample stands for, per side
+    const int& scale() const { return mScale; }
+    
+    // Iteration of the image the pixels belong to
+    const int& iteration() const { return mIteration; }
+    
     // Reference to pixel data owned by this object (server-side)
-    const float& pixel(int index = 0) { return mPixelStore[index]; }
+    const float& pixel(int index = 0) const { return mPixelStore[index]; }
     
     // Deallocate Aov name
     void free();
@@ -184,15 +214,16 @@ private:
     // Sample Per Pixel
     int mSpp;
     
-    // Memory
-    long long mRam;
-    
-    // Time
-    unsigned int mTime;
-    
     // AOV Name
     const char *mAovName;
     
+    // Preview tier, and the downsampling of the pixels sent
+    bool mPreview;
+    int mScale;
+    
+    // Image iteration, filled in by the Client
+    int mIteration;
+    
     // Our pixel data pointer (for driver-owned pixels)
     float *mpData;
     
@@ -201,11 +232,116 @@ private:
 };
 
 
+// Statistics of a render, sent a few times a second rather than
+// with every bucket
+class RenderStats
+{
+    friend class Client;
+    friend class Connection;
+    
+public:
+    RenderStats(const long long& ram = 0,
+                const long long& peak_ram = 0,
+                const unsigned int& time = 0,
+                const int& buckets = 0);
+    
+    // Taken memory while rendering, and the most it took so far
+    const long long& ram() const { return mRam; }
+    const long long& peak_ram() const { return mPeakRam; }
+    
+    // Taken time while rendering
+    const unsigned int& time() const { return mTime; }
+    
+    // Buckets rendered since the image was opened
+    const int& buckets() const { return mBuckets; }
+    
+    // Iteration of the image the statistics belong to
+    const int& iteration() const { return mIteration; }
+    
+private:
+    long long mRam, mPeakRam;
+    unsigned int mTime;
+    int mBuckets, mIteration;
+};
+
+// Part of the image the viewer is looking at, sent back to the driver
+// so the buckets in view go first. Bounds are inclusive and in the
+// coordinates of the buckets, it's empty while nothing is looked at.
+class ViewRegion
+{
+    friend class Client;
+    friend class Connection;
+    
+public:
+    ViewRegion(const int& min_x = 0,
+               const int& min_y = 0,
+               const int& max_x = -1,
+               const int& max_y = -1,
+               const float& zoom = 1.0f);
+    
+    bool empty() const { return mMaxX < mMinX || mMaxY < mMinY; }
+    
+    // Whether the bucket is at least partly in view
+    bool intersects(const int& x,
+                    const int& y,
+                    const int& width,
+                    const int& height) const;
+    
+    // Scale the viewer shows the image at
+    const float& zoom() const { return mZoom; }
+    
+    bool operator==(const ViewRegion& other) const;
+    bool operator!=(const ViewRegion& other) const { return !(*this == other); }
+    
+private:
+    int mMinX, mMinY, mMaxX, mMaxY;
+    float mZoom;
+};
+
+// AOVs the node wants the driver to send. The first AOV of every
+// bucket, the beauty, and the ones being viewed are always wanted,
+// the others only while all of them are.
+class AovSubscription
+{
+    friend class Client;
+    friend class Connection;
+    
+public:
+    AovSubscription(const bool& all = true): mAll(all) {}
+    
+    // An AOV the viewer is showing
+    void add_viewed(const std::string& aov);
+    
+    bool wants(const char* aov, const bool& beauty) const;
+    bool viewed(const char* aov) const;
+    
+    const bool& all() const { return mAll; }
+    
+    bool operator==(const AovSubscription& other) const;
+    bool operator!=(const AovSubscription& other) const { return !(*this == other); }
+    
+private:
+    bool mAll;
+    std::vector<std::string> mViewed;
+};
+
+// What the node asks of the renders, sent back to the driver.
+// A paused render holds on to its buckets until it runs again,
+// an abort ends the current iteration of it.
+enum RenderControl
+{
+    RENDER_RUN = 0,
+    RENDER_PAUSE,
+    RENDER_ABORT
+};
+
 
 // Used to send an image to a Server
 // The Client class is created each time an application wants to send
 // an image to the Server. Once it is instantiated the application should
 // call open_image(), send_pixels(), and close_image() to send an image to the Server
+// Several renders may share one Client and its connection by tagging
+// what they send with their own stream, see set_stream().
 class Client
 {
     friend class Server;
@@ -216,6 +352,11 @@ public:
     
     ~Client();
     
+    // Tags what's sent from now on with the stream. Once a stream is
+    // set the connection stays open from one image to the next, and
+    // close_image() only closes the image of the current stream.
+    void set_stream(const int& stream);
+    
     // Sends a message to the Server to open a new image
     // The header parameter is used to tell the Server the size of image
     // buffer to allocate.
@@ -226,13 +367,38 @@ public:
     // pixel blocks to the Server. The Data object passed must correctly
     // specify the block position and dimensions as well as provide a
     // pointer to pixel data.
-    void send_pixels(DataPixels& data);
+    // A scale above 1 box filters scale x scale pixels into one on the
+    // way, the Server shows them upscaled until the exact ones arrive.
+    void send_pixels(DataPixels& data, const int& scale = 1);
+    
+    // Sends a cheap 8 bit preview of a section, the Server shows it
+    // until send_pixels() delivers the exact data of the section
+    void send_preview(DataPixels& data);
+    
+    // Sends the statistics of the render of the open image
+    void send_stats(RenderStats& stats);
     
     // Sends a message to the Server that the Clients has finished
     // This tells the Server that a Client has finished sending pixel
     // information for an image.
     void close_image();
     
+    // Reads what the Server sent back meanwhile, never blocks.
+    // Returns true if anything has changed.
+    bool poll();
+    
+    // Latest region the viewer is looking at
+    const ViewRegion& view_region() const { return mViewRegion; }
+    
+    // Latest AOVs the node wants
+    const AovSubscription& subscription() const { return mSubscription; }
+    
+    // Whether the node wants the render held back
+    bool paused() const { return mPaused; }
+    
+    // Whether the node asked to abort since the last call
+    bool take_abort();
+    
     bool connected() { return mIsConnected; }
 
 private:
@@ -240,11 +406,28 @@ private:
     void disconnect();
     void quit();
     
+    // Message type, image id and the section's layout
+    void send_pixels_info(const int& key, DataPixels& data);
+    
+    // Lets the Server know the stream changed since the last message
+    void send_stream();
+    
     // Store the port we should connect to
     std::string mHost;
     int mPort, mImageId;
     bool mIsConnected;
     
+    // Stream being sent and the last one the Server was told about,
+    // and the iteration of the image of each stream
+    int mStream, mSentStream;
+    bool mMultiplexed;
+    std::map<int, int> mIterations;
+    
+    // Sent back by the Server
+    ViewRegion mViewRegion;
+    AovSubscription mSubscription;
+    bool mPaused, mAbort;
+    
     // TCP stuff
     boost::asio::io_service mIoService;
     boost::asio::ip::tcp::socket mSocket;
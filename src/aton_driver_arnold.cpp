@@ -5,6 +5,9 @@ All rights reserved. See COPYING.txt for more details.
 */
 
 #include <ai.h>
+#include <map>
+#include <list>
+#include <algorithm>
 #include "aton_client.h"
 
 AI_DRIVER_NODE_EXPORT_METHODS(AtonDriverMtd);
@@ -30,18 +33,658 @@ inline const long long calc_rarea(int minx,
     return w * h;
 }
 
-struct ShaderData
+// Most pixel bytes held for sending before the renders wait,
+// shared by the drivers sending over the same connection
+const size_t SEND_BUDGET = 256 * 1048576;
+
+// Most sent buckets kept for the next ones to copy into
+const size_t SPARE_BUCKETS = 64;
+
+// Render statistics sent per second
+const int STATS_RATE = 4;
+
+// Seconds the link would take to send what's queued before the
+// buckets go out 2x2 and 4x4 downsampled. It takes half of that
+// to go back up a step.
+const double DOWNSAMPLE_2_BACKLOG = 1.0;
+const double DOWNSAMPLE_4_BACKLOG = 4.0;
+
+// One bucket of some AOVs, waiting to be sent. Spare buckets keep
+// their pixel buffers, there may be more of them than AOVs.
+struct PendingBucket
+{
+    int xo, yo, width, height;
+    std::vector<std::string> aovs;
+    std::vector<int> spp;
+    std::vector<std::vector<float> > pixels;
+    size_t bytes;
+    
+    // Sent as an 8 bit preview of the beauty
+    bool preview;
+    
+    // Sent downsampled, the exact pixels are queued again
+    int scale;
+};
+
+// Buckets of one driver the sender hasn't got to yet. Once the link
+// falls behind they pile up here, and the ones the viewer is looking
+// at are sent first. The beauty and the viewed AOVs of a bucket go out
+// right away, the other AOVs are deferred until nothing else is left.
+// In preview mode an 8 bit beauty goes out ahead of all of them.
+// While the link can't keep up the buckets go out downsampled, and
+// their exact pixels are refined once everything else is sent.
+struct SendQueue
 {
+    SendQueue(): stream(0), xres(0), yres(0), open(false), sending(false),
+                 rendered(0), peak_ram(0) {}
+    
+    bool empty() const
+    {
+        return previews.empty() && buckets.empty() && deferred.empty() && refine.empty();
+    }
+    
+    std::list<PendingBucket*> previews, buckets, deferred, refine;
+    
+    // Stream of the driver on the connection, and the resolution
+    // of the image it has open
+    int stream, xres, yres;
+    bool open;
+    
+    // A bucket of it is being sent
+    bool sending;
+    
+    // Buckets rendered and the most memory taken since the image opened
+    int rendered;
+    long long peak_ram;
+};
+
+// One connection to a server, shared by the drivers sending to the
+// same host and port. Their buckets go out as streams of their own,
+// taking turns on one sender thread, and a bucket sent is kept for
+// the next one to copy into. The node may pause the render, which
+// holds the render threads in the driver, or abort it, which lets
+// them go without queueing anything.
+struct SendLink
+{
+    SendLink(const std::string& host, const int& port): host(host),
+                                                        port(port),
+                                                        bytes(0),
+                                                        refine_bytes(0),
+                                                        scale(1),
+                                                        rate(0),
+                                                        paused(false),
+                                                        aborting(false),
+                                                        failed(false),
+                                                        quit(false),
+                                                        users(0),
+                                                        next_stream(1),
+                                                        thread(NULL),
+                                                        client(new Client(host, port)),
+                                                        sender_timer(io_service)
+    {
+        AiCritSecInit(&lock);
+        AiCritSecInit(&send_lock);
+    }
+    
+    ~SendLink()
+    {
+        std::vector<PendingBucket*>::iterator it;
+        for(it = spare.begin(); it != spare.end(); ++it)
+            delete *it;
+        delete client;
+        AiCritSecClose(&lock);
+        AiCritSecClose(&send_lock);
+    }
+    
+    const std::string host;
+    const int port;
+    
+    // Guards the fields below
+    AtCritSec lock;
+    std::list<SendQueue*> queues;
+    std::vector<PendingBucket*> spare;
+    size_t bytes, refine_bytes;
+    
+    // Downsampling of the buckets, and the bytes per second
+    // the link has been taking lately
+    int scale;
+    double rate;
+    
+    // Sent back by the server
+    ViewRegion region;
+    AovSubscription subscription;
+    bool paused, aborting;
+    
+    // The server is gone, the next image opened connects again
+    bool failed;
+    
+    bool quit;
+    int users, next_stream;
+    void* thread;
+    
+    // Held while the client is used
+    AtCritSec send_lock;
     Client* client;
+    
+    // For the threads to idle on, each render thread has its own timer
+    boost::asio::io_service io_service;
+    boost::asio::deadline_timer sender_timer;
+};
+
+// Links by host and port
+struct LinkRegistry
+{
+    LinkRegistry() { AiCritSecInit(&lock); }
+    ~LinkRegistry() { AiCritSecClose(&lock); }
+    
+    AtCritSec lock;
+    std::map<std::string, SendLink*> links;
+};
+
+static LinkRegistry registry;
+
+struct ShaderData
+{
+    SendLink* link;
+    SendQueue* queue;
     long long index;
     int xres, yres, min_x, min_y, max_x, max_y;
+    bool preview;
+    
+    // This driver, the images it opened so far and the frame of the last one
+    long long source;
+    int iteration;
+    float frame;
 };
 
+static void idle(boost::asio::deadline_timer& timer)
+{
+    timer.expires_from_now(boost::posix_time::milliseconds(1));
+    boost::system::error_code ec;
+    timer.wait(ec);
+}
+
+// A spare bucket of the link, or a new one
+static PendingBucket* new_bucket(SendLink& link,
+                                 const int& xo, const int& yo,
+                                 const int& width, const int& height)
+{
+    PendingBucket* bucket = NULL;
+    AiCritSecEnter(&link.lock);
+    if (!link.spare.empty())
+    {
+        bucket = link.spare.back();
+        link.spare.pop_back();
+    }
+    AiCritSecLeave(&link.lock);
+    
+    if (bucket == NULL)
+        bucket = new PendingBucket();
+    bucket->xo = xo;
+    bucket->yo = yo;
+    bucket->width = width;
+    bucket->height = height;
+    bucket->aovs.clear();
+    bucket->spp.clear();
+    bucket->bytes = 0;
+    bucket->preview = false;
+    bucket->scale = 1;
+    return bucket;
+}
+
+// Keep the bucket's buffers for the next one, the caller holds the lock
+static void free_bucket(SendLink& link, PendingBucket* bucket)
+{
+    if (link.spare.size() < SPARE_BUCKETS)
+        link.spare.push_back(bucket);
+    else
+        delete bucket;
+}
+
+// Copy the pixels of an AOV into the bucket, reusing its buffers
+static void add_aov(PendingBucket* bucket,
+                    const char* aov,
+                    const int& spp,
+                    const float* ptr,
+                    const int& num_samples)
+{
+    const size_t i = bucket->aovs.size();
+    if (bucket->pixels.size() <= i)
+        bucket->pixels.resize(i + 1);
+    bucket->aovs.push_back(aov);
+    bucket->spp.push_back(spp);
+    bucket->pixels[i].assign(ptr, ptr + num_samples);
+    bucket->bytes += num_samples * sizeof(float);
+}
+
+// Downsampling for a link that would take this many seconds to send what's queued
+static int transport_scale(const double& backlog, const int& scale)
+{
+    if (backlog > DOWNSAMPLE_4_BACKLOG)
+        return 4;
+    if (backlog > DOWNSAMPLE_2_BACKLOG)
+        return scale == 4 && backlog > DOWNSAMPLE_4_BACKLOG / 2 ? 4 : 2;
+    if (backlog > DOWNSAMPLE_2_BACKLOG / 2)
+        return std::min(scale, 2);
+    return 1;
+}
+
+// A newer pass of the bucket outdates the exact pixels of the last one
+static void drop_refinements(SendLink& link, SendQueue& queue, const PendingBucket* bucket)
+{
+    std::list<PendingBucket*>::iterator it = queue.refine.begin();
+    while (it != queue.refine.end())
+    {
+        PendingBucket* old = *it;
+        if (old->xo == bucket->xo && old->yo == bucket->yo &&
+            old->width == bucket->width && old->height == bucket->height &&
+            old->aovs == bucket->aovs)
+        {
+            link.bytes -= old->bytes;
+            link.refine_bytes -= old->bytes;
+            free_bucket(link, old);
+            it = queue.refine.erase(it);
+        }
+        else
+            ++it;
+    }
+}
+
+// Take the oldest bucket in view, or the oldest one
+static PendingBucket* take_bucket(std::list<PendingBucket*>& buckets,
+                                  const ViewRegion& region)
+{
+    std::list<PendingBucket*>::iterator it, pick = buckets.begin();
+    if (!region.empty())
+    {
+        for(it = buckets.begin(); it != buckets.end(); ++it)
+        {
+            if (region.intersects((*it)->xo, (*it)->yo, (*it)->width, (*it)->height))
+            {
+                pick = it;
+                break;
+            }
+        }
+    }
+    
+    if (pick == buckets.end())
+        return NULL;
+    
+    PendingBucket* bucket = *pick;
+    buckets.erase(pick);
+    return bucket;
+}
+
+// Throw away what the driver hasn't sent yet
+static void drop_all(SendLink& link, SendQueue& queue)
+{
+    std::list<PendingBucket*>* lists[4] = {&queue.previews, &queue.buckets,
+                                           &queue.deferred, &queue.refine};
+    for (int i = 0; i < 4; ++i)
+    {
+        std::list<PendingBucket*>::iterator it;
+        for(it = lists[i]->begin(); it != lists[i]->end(); ++it)
+        {
+            link.bytes -= (*it)->bytes;
+            if (lists[i] == &queue.refine)
+                link.refine_bytes -= (*it)->bytes;
+            free_bucket(link, *it);
+        }
+        lists[i]->clear();
+    }
+}
+
+// Previews and the beauty first, deferred AOVs only once the beauty
+// has caught up, and the exact pixels of the downsampled buckets last
+static PendingBucket* next_bucket(SendLink& link, SendQueue& queue, const int& pass)
+{
+    PendingBucket* bucket = NULL;
+    switch (pass)
+    {
+        case 0:
+        {
+            bucket = take_bucket(queue.previews, link.region);
+            
+            // Not worth it while the exact pixels are next anyway
+            if (bucket != NULL && queue.buckets.size() <= 1)
+            {
+                link.bytes -= bucket->bytes;
+                free_bucket(link, bucket);
+                bucket = NULL;
+            }
+            
+            if (bucket == NULL && (bucket = take_bucket(queue.buckets, link.region)) != NULL)
+            {
+                drop_refinements(link, queue, bucket);
+                bucket->scale = link.scale;
+            }
+            break;
+        }
+        case 1:
+            bucket = take_bucket(queue.deferred, link.region);
+            break;
+        default:
+            if ((bucket = take_bucket(queue.refine, link.region)) != NULL)
+                link.refine_bytes -= bucket->bytes;
+    }
+    return bucket;
+}
+
+// The drivers take turns, the one served longest ago first
+static PendingBucket* next_bucket(SendLink& link, SendQueue*& queue)
+{
+    for (int pass = 0; pass < 3; ++pass)
+    {
+        std::list<SendQueue*>::iterator it;
+        for(it = link.queues.begin(); it != link.queues.end(); ++it)
+        {
+            PendingBucket* bucket = next_bucket(link, **it, pass);
+            if (bucket != NULL)
+            {
+                queue = *it;
+                link.queues.splice(link.queues.end(), link.queues, it);
+                return bucket;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Tell the server how the renders of the drivers are doing,
+// returns false once it's gone
+static bool send_stats(SendLink& link)
+{
+    const long long ram = AiMsgUtilGetUsedMemory();
+    const unsigned int time = AiMsgUtilGetElapsedTime();
+    
+    std::vector<int> streams;
+    std::vector<RenderStats> stats;
+    AiCritSecEnter(&link.lock);
+    std::list<SendQueue*>::iterator it;
+    for(it = link.queues.begin(); it != link.queues.end(); ++it)
+    {
+        SendQueue& queue = **it;
+        if (!queue.open)
+            continue;
+        queue.peak_ram = std::max(queue.peak_ram, ram);
+        streams.push_back(queue.stream);
+        stats.push_back(RenderStats(ram, queue.peak_ram, time, queue.rendered));
+    }
+    AiCritSecLeave(&link.lock);
+    
+    bool sent = true;
+    AiCritSecEnter(&link.send_lock);
+    for (size_t i = 0; sent && i < streams.size(); ++i)
+    {
+        try
+        {
+            link.client->set_stream(streams[i]);
+            link.client->send_stats(stats[i]);
+        }
+        catch(const std::exception&)
+        {
+            sent = false;
+        }
+    }
+    AiCritSecLeave(&link.send_lock);
+    return sent;
+}
+
+// Sends the queued buckets of the drivers sharing the link
+static unsigned int sender_thread(void* ptr)
+{
+    SendLink& link = *reinterpret_cast<SendLink*>(ptr);
+    
+    using namespace boost::posix_time;
+    ptime stats_time = microsec_clock::universal_time();
+    
+    while (true)
+    {
+        AiCritSecEnter(&link.lock);
+        SendQueue* queue = NULL;
+        PendingBucket* bucket = next_bucket(link, queue);
+        const bool quit = link.quit;
+        bool failed = link.failed;
+        int stream = 0, xres = 0, yres = 0;
+        if (bucket != NULL)
+        {
+            queue->sending = true;
+            stream = queue->stream;
+            xres = queue->xres;
+            yres = queue->yres;
+        }
+        AiCritSecLeave(&link.lock);
+        
+        if (bucket == NULL)
+        {
+            if (quit)
+                break;
+            idle(link.sender_timer);
+        }
+        else
+        {
+            const ptime start = microsec_clock::universal_time();
+            size_t sent = 0;
+            
+            // Drop the rest once the server is gone
+            AiCritSecEnter(&link.send_lock);
+            link.client->set_stream(stream);
+            for (size_t i = 0; !failed && i < bucket->aovs.size(); ++i)
+            {
+                DataPixels dp(xres,
+                              yres,
+                              bucket->xo,
+                              bucket->yo,
+                              bucket->width,
+                              bucket->height,
+                              bucket->spp[i],
+                              bucket->aovs[i].c_str(),
+                              &bucket->pixels[i][0]);
+                try
+                {
+                    if (bucket->preview)
+                        link.client->send_preview(dp);
+                    else
+                        link.client->send_pixels(dp, bucket->scale);
+                    sent += bucket->pixels[i].size() * sizeof(float) /
+                            (bucket->scale * bucket->scale * (bucket->preview ? 4 : 1));
+                }
+                catch(const std::exception &e)
+                {
+                    AiMsgError("ATON | Lost the connection! %s", e.what());
+                    failed = true;
+                }
+            }
+            AiCritSecLeave(&link.send_lock);
+            
+            const double seconds = (microsec_clock::universal_time() - start).total_microseconds() / 1e6;
+            
+            AiCritSecEnter(&link.lock);
+            queue->sending = false;
+            
+            // Follow the throughput, and ease off the resolution once it falls behind
+            if (sent > 0 && seconds > 0)
+            {
+                const double rate = sent / seconds;
+                link.rate = link.rate > 0 ? link.rate * 0.8 + rate * 0.2 : rate;
+                link.scale = transport_scale((link.bytes - link.refine_bytes) / link.rate,
+                                             link.scale);
+            }
+            
+            if (bucket->scale > 1 && !failed)
+            {
+                bucket->scale = 1;
+                queue->refine.push_back(bucket);
+                link.refine_bytes += bucket->bytes;
+            }
+            else
+            {
+                link.bytes -= bucket->bytes;
+                free_bucket(link, bucket);
+            }
+            AiCritSecLeave(&link.lock);
+        }
+        
+        // Statistics go out at a steady rate, whatever the buckets do
+        const ptime now = microsec_clock::universal_time();
+        if (!failed && now - stats_time >= milliseconds(1000 / STATS_RATE))
+        {
+            failed = !send_stats(link);
+            stats_time = now;
+        }
+        
+        // Pick up what the viewer is looking at
+        bool changed = false, abort = false;
+        ViewRegion region;
+        AovSubscription subscription;
+        bool paused = false;
+        if (!failed)
+        {
+            AiCritSecEnter(&link.send_lock);
+            try
+            {
+                if ((changed = link.client->poll()))
+                {
+                    abort = link.client->take_abort();
+                    region = link.client->view_region();
+                    subscription = link.client->subscription();
+                    paused = link.client->paused();
+                }
+            }
+            catch(const std::exception&)
+            {
+                failed = true;
+            }
+            AiCritSecLeave(&link.send_lock);
+        }
+        
+        AiCritSecEnter(&link.lock);
+        if (changed)
+        {
+            link.region = region;
+            link.subscription = subscription;
+            link.paused = paused;
+            link.aborting = link.aborting || abort;
+        }
+        
+        // Nothing gets through nor resumes the render until the
+        // drivers open their next images
+        if (failed)
+        {
+            link.failed = true;
+            link.paused = false;
+            std::list<SendQueue*>::iterator it;
+            for(it = link.queues.begin(); it != link.queues.end(); ++it)
+            {
+                drop_all(link, **it);
+                (*it)->open = false;
+            }
+        }
+        AiCritSecLeave(&link.lock);
+        
+        // Returns once the render threads are out, they leave
+        // the driver right away while aborting
+        if (abort)
+        {
+            AiMsgInfo("ATON | Render aborted from Nuke");
+            AiRenderAbort();
+        }
+    }
+    return 0;
+}
+
+// The link to the host and port, its sender is started by the first driver
+static SendLink* attach(const char* host, const int& port, SendQueue& queue)
+{
+    char key[512];
+    snprintf(key, sizeof(key), "%s:%d", host, port);
+    
+    AiCritSecEnter(&registry.lock);
+    SendLink*& link = registry.links[key];
+    if (link == NULL)
+        link = new SendLink(host, port);
+    
+    AiCritSecEnter(&link->lock);
+    link->users++;
+    link->queues.push_back(&queue);
+    queue.stream = link->next_stream++;
+    if (link->thread == NULL)
+        link->thread = AiThreadCreate(sender_thread, link, AI_PRIORITY_NORMAL);
+    AiCritSecLeave(&link->lock);
+    
+    SendLink* attached = link;
+    AiCritSecLeave(&registry.lock);
+    return attached;
+}
+
+// Wait for the sender to finish the driver's buckets, or throw away what's left
+static void flush(SendLink& link, SendQueue& queue, const bool& drop)
+{
+    boost::asio::deadline_timer timer(link.io_service);
+    while (true)
+    {
+        AiCritSecEnter(&link.lock);
+        if (drop)
+            drop_all(link, queue);
+        const bool done = queue.empty() && !queue.sending;
+        AiCritSecLeave(&link.lock);
+        
+        if (done)
+            break;
+        idle(timer);
+    }
+}
+
+// Close the driver's image once it's sent, the last driver
+// out of the link closes the connection
+static void detach(SendLink* link, SendQueue& queue)
+{
+    flush(*link, queue, false);
+    
+    // The final statistics, then the image is done
+    send_stats(*link);
+    
+    AiCritSecEnter(&link->send_lock);
+    if (queue.open)
+    {
+        try
+        {
+            link->client->set_stream(queue.stream);
+            link->client->close_image();
+        }
+        catch(const std::exception&) {}
+    }
+    AiCritSecLeave(&link->send_lock);
+    
+    char key[512];
+    snprintf(key, sizeof(key), "%s:%d", link->host.c_str(), link->port);
+    
+    AiCritSecEnter(&registry.lock);
+    AiCritSecEnter(&link->lock);
+    queue.open = false;
+    link->queues.remove(&queue);
+    const bool last = --link->users == 0;
+    link->quit = last;
+    AiCritSecLeave(&link->lock);
+    if (last)
+        registry.links.erase(key);
+    AiCritSecLeave(&registry.lock);
+    
+    if (last)
+    {
+        AiThreadWait(link->thread);
+        AiThreadClose(link->thread);
+        delete link;
+    }
+}
+
 node_parameters
 {
     AiParameterStr("host", get_host().c_str());
     AiParameterInt("port", get_port());
     AiParameterStr("output", "");
+    AiParameterInt("session", 0);
+    AiParameterBool("preview", false);
     
 #ifdef ARNOLD_5
     AiMetaDataSetStr(nentry, NULL, AtString("maya.translator"), AtString("aton"));
@@ -59,8 +702,13 @@ node_parameters
 node_initialize
 {
     ShaderData* data = (ShaderData*)AiMalloc(sizeof(ShaderData));
-    data->client = NULL;
+    data->link = NULL;
+    data->queue = new SendQueue();
     data->index = get_unique_id();
+    data->preview = false;
+    data->source = data->index;
+    data->iteration = 0;
+    data->frame = 0;
 
 #ifdef ARNOLD_5
     AiDriverInitialize(node, true);
@@ -112,14 +760,52 @@ driver_open
                                              data_window.miny,
                                              data_window.maxy);
     
+    // Get Data Window, shifted like the buckets are
+    const int shift_x = data->min_x < 0 ? -data->min_x : 0;
+    const int shift_y = data->min_y < 0 ? -data->min_y : 0;
+    const int window[4] = {data_window.minx + shift_x,
+                           data_window.miny + shift_y,
+                           data_window.maxx + shift_x,
+                           data_window.maxy + shift_y};
+    
     // Get Arnold version
     char arch[3], major[3], minor[3], fix[3];
     AiGetVersion(arch, major, minor, fix);
     const int version = pack_4_int(atoi(arch), atoi(major), atoi(minor), atoi(fix));
         
+    // Processes rendering regions of one frame share a session,
+    // the server merges them into one image. Without one the driver
+    // goes back to its own index.
+    const long long previous = data->index;
+    const int session = AiNodeGetInt(node, AtString("session"));
+    data->index = session != 0 ? session : data->source;
+    
     // Get Frame
     const float frame = AiNodeGetFlt(options, AtString("frame"));
     
+    // Get Host and Port
+    const char* host = AiNodeGetStr(node, AtString("host"));
+    const int port = AiNodeGetInt(node, AtString("port"));
+    
+    // Drivers sending to the same host and port share the connection
+    SendQueue& queue = *data->queue;
+    if (data->link != NULL && (data->link->host != host || data->link->port != port))
+    {
+        detach(data->link, queue);
+        data->link = NULL;
+    }
+    if (data->link == NULL)
+        data->link = attach(host, port, queue);
+    SendLink& link = *data->link;
+    
+    // The last iteration may still be sending. The buckets it has
+    // left of a restarted frame are overwritten anyway, so they're
+    // dropped, those of another frame are sent first.
+    const bool restart = data->iteration > 0 && data->index == previous && data->frame == frame;
+    flush(link, queue, restart);
+    data->iteration++;
+    data->frame = frame;
+    
     // Get Camera Field of view
     AtNode* camera = (AtNode*)AiNodeGetPtr(options, AtString("camera"));
     const float cam_fov = AiNodeGetFlt(camera, AtString("fov"));
@@ -157,6 +843,9 @@ driver_open
 
     const char* output = AiNodeGetStr(node, AtString("output"));
     
+    // Slow links get an 8 bit beauty first
+    data->preview = AiNodeGetBool(node, AtString("preview"));
+    
     // Make image header & send to server
     DataHeader dh(data->index,
                   data->xres,
@@ -168,25 +857,58 @@ driver_open
                   cam_fov,
                   cam_matrix,
                   samples,
-                  output);
+                  output,
+                  window,
+                  data->source,
+                  data->iteration);
 
-    // Get Host and Port
-    const char* host = AiNodeGetStr(node, AtString("host"));
-    const int port = AiNodeGetInt(node, AtString("port"));
+    // Connect again once the server was lost
+    AiCritSecEnter(&link.lock);
+    const bool failed = link.failed;
+    link.failed = false;
+    link.aborting = false;
+    AiCritSecLeave(&link.lock);
     
-    if (data->client == NULL)
-        data->client = new Client(host, port);
+    AiCritSecEnter(&link.send_lock);
+    if (failed)
+    {
+        delete link.client;
+        link.client = new Client(link.host, link.port);
+    }
     
+    bool open = true;
     try
     {
-        data->client->open_image(dh);
+        link.client->set_stream(queue.stream);
+        link.client->open_image(dh);
     }
     catch(const std::exception &e)
     {
         const char* err = e.what();
         AiMsgError("ATON | Host %s with Port %i was not found! %s", host, port, err);
+        open = false;
     }
-
+    const ViewRegion region = link.client->view_region();
+    const AovSubscription subscription = link.client->subscription();
+    const bool paused = link.client->paused();
+    AiCritSecLeave(&link.send_lock);
+    
+    // Buckets are sent on the sender thread of the link from now on
+    AiCritSecEnter(&link.lock);
+    queue.xres = data->xres;
+    queue.yres = data->yres;
+    queue.open = open;
+    queue.rendered = 0;
+    queue.peak_ram = 0;
+    if (open)
+    {
+        link.region = region;
+        link.subscription = subscription;
+        link.paused = paused;
+    }
+    else
+        link.failed = true;
+    AiCritSecLeave(&link.lock);
 }
 
 driver_needs_bucket { return true; }
@@ -204,6 +926,27 @@ driver_write_bucket
     ShaderData* data = (ShaderData*)AiDriverGetLocalData(node);
 #endif
 
+    SendLink* link = data->link;
+    SendQueue& queue = *data->queue;
+    if (link == NULL)
+        return;
+    
+    // Hold the render thread while the node has it paused
+    boost::asio::deadline_timer timer(link->io_service);
+    while (true)
+    {
+        AiCritSecEnter(&link->lock);
+        const bool open = queue.open && !link->aborting;
+        const bool paused = link->paused;
+        AiCritSecLeave(&link->lock);
+        
+        if (!open)
+            return;
+        if (!paused)
+            break;
+        idle(timer);
+    }
+
     int pixel_type;
     int spp = 0;
     const void* bucket_data;
@@ -214,11 +957,26 @@ driver_write_bucket
     if (data->min_y < 0)
         bucket_yo = bucket_yo - data->min_y;
     
+    // Pixels are only valid until we return, keep a copy for the sender
+    PendingBucket* bucket = new_bucket(*link, bucket_xo, bucket_yo, bucket_size_x, bucket_size_y);
+    PendingBucket* deferred = new_bucket(*link, bucket_xo, bucket_yo, bucket_size_x, bucket_size_y);
+    
+    // AOVs the node has no use for are never copied nor sent
+    AiCritSecEnter(&link->lock);
+    const AovSubscription subscription = link->subscription;
+    AiCritSecLeave(&link->lock);
+    
+    bool beauty = true;
     while (AiOutputIteratorGetNext(iterator, &aov_name, &pixel_type, &bucket_data))
     {
         const float* ptr = reinterpret_cast<const float*>(bucket_data);
-        const long long memory = AiMsgUtilGetUsedMemory();
-        const unsigned int time = AiMsgUtilGetElapsedTime();
+        const bool wanted = subscription.wants(aov_name, beauty);
+        
+        // The beauty and what's being looked at can't wait
+        PendingBucket* target = beauty || subscription.viewed(aov_name) ? bucket : deferred;
+        beauty = false;
+        if (!wanted)
+            continue;
         
         switch (pixel_type)
         {
@@ -234,24 +992,61 @@ driver_write_bucket
                 spp = 3;
         }
         
-        // Create our DataPixels object
-        DataPixels dp(data->xres,
-                      data->yres,
-                      bucket_xo,
-                      bucket_yo,
-                      bucket_size_x,
-                      bucket_size_y,
-                      spp,
-                      memory,
-                      time,
-                      aov_name,
-                      ptr);
-
-        // Send it to the server
-        data->client->send_pixels(dp);
+        add_aov(target, aov_name, spp, ptr, bucket_size_x * bucket_size_y * spp);
+    }
+    
+    // The beauty once more, to be sent as a preview
+    PendingBucket* preview = NULL;
+    if (data->preview && !bucket->aovs.empty())
+    {
+        preview = new_bucket(*link, bucket_xo, bucket_yo, bucket_size_x, bucket_size_y);
+        add_aov(preview, bucket->aovs[0].c_str(), bucket->spp[0],
+                &bucket->pixels[0][0], static_cast<int>(bucket->pixels[0].size()));
+        preview->preview = true;
+    }
+    
+    // Hold the render back while the link is behind by too much
+    while (true)
+    {
+        AiCritSecEnter(&link->lock);
+        const bool open = queue.open && !link->aborting;
+        const bool full = open && link->bytes > SEND_BUDGET;
+        if (!open)
+        {
+            // Lost the server meanwhile
+            free_bucket(*link, bucket);
+            free_bucket(*link, deferred);
+            if (preview != NULL)
+                free_bucket(*link, preview);
+        }
+        else if (!full)
+        {
+            queue.rendered++;
+            queue.buckets.push_back(bucket);
+            link->bytes += bucket->bytes;
+            if (preview != NULL)
+            {
+                queue.previews.push_back(preview);
+                link->bytes += preview->bytes;
+            }
+            if (!deferred->aovs.empty())
+            {
+                queue.deferred.push_back(deferred);
+                link->bytes += deferred->bytes;
+            }
+            else
+                free_bucket(*link, deferred);
+        }
+        AiCritSecLeave(&link->lock);
+        
+        if (!full)
+            break;
+        idle(timer);
     }
 }
 
+// The sender finishes what's queued on its own, the next
+// iteration or the end of the render wait for it
 driver_close {}
 
 node_finish
@@ -262,9 +1057,9 @@ node_finish
 #else
     ShaderData* data = (ShaderData*)AiDriverGetLocalData(node);
 #endif
-    if (data->client->connected())
-        data->client->close_image();
-    delete data->client;
+    if (data->link != NULL)
+        detach(data->link, *data->queue);
+    delete data->queue;
     AiFree(data);
 
 #ifndef ARNOLD_5
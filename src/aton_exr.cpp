@@ -0,0 +1,204 @@
+/*
+Copyright (c) 2018,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_exr.h"
+#include <DDImage/Thread.h>
+#include <algorithm>
+
+#include <OpenEXR/ImathBox.h>
+#include <OpenEXR/ImfHeader.h>
+#include <OpenEXR/ImfPartType.h>
+#include <OpenEXR/ImfThreading.h>
+#include <OpenEXR/ImfChannelList.h>
+#include <OpenEXR/ImfFrameBuffer.h>
+#include <OpenEXR/ImfOutputPart.h>
+#include <OpenEXR/ImfIntAttribute.h>
+#include <OpenEXR/ImfFloatAttribute.h>
+#include <OpenEXR/ImfMultiPartOutputFile.h>
+
+// Channel names of an AOV, matching the layers the node shows
+static std::vector<std::string> exr_channels(const std::string& aov,
+                                             const bool& color,
+                                             const bool& alpha)
+{
+    using namespace chStr;
+    std::vector<std::string> names;
+    
+    if (aov == RGBA)
+    {
+        names.push_back("R");
+        names.push_back("G");
+        names.push_back("B");
+    }
+    else if (aov == N || aov == P)
+    {
+        names.push_back(aov + _X);
+        names.push_back(aov + _Y);
+        names.push_back(aov + _Z);
+    }
+    else if (color)
+    {
+        names.push_back(aov + ".R");
+        names.push_back(aov + ".G");
+        names.push_back(aov + ".B");
+    }
+    
+    if (alpha)
+        names.push_back(aov == RGBA ? "A" : aov + ".A");
+    else if (!color)
+        names.push_back(aov);
+    
+    return names;
+}
+
+// Scanlines read and written at a time
+const int BLOCK_ROWS = 64;
+
+struct ExrFile
+{
+    std::vector<Imf::Header> headers;
+    boost::scoped_ptr<Imf::MultiPartOutputFile> file;
+};
+
+ExrCapture::ExrCapture(const std::string& path, const RenderBuffer& rb): _file(new ExrFile),
+                                                                         _aovs(rb.get_aovs()),
+                                                                         _window(rb.get_data_window()),
+                                                                         _height(rb.get_height()),
+                                                                         _line(0),
+                                                                         _rows(0)
+{
+    const int& w = rb.get_width();
+    const int& h = _height;
+    
+    // The planes only cover the data window
+    const int dx = _window.x();
+    const int dy = _window.y();
+    const int dw = _window.w();
+    const int dh = _window.h();
+    const Imath::Box2i display_window(Imath::V2i(0, 0), Imath::V2i(w - 1, h - 1));
+    const Imath::Box2i data_window(Imath::V2i(dx, h - dy - dh), Imath::V2i(dx + dw - 1, h - dy - 1));
+    
+    int channels = 0;
+    for (size_t b = 0; b < _aovs.size(); ++b)
+    {
+        const bool color = rb.get_color_data(b) != NULL;
+        const bool floats = rb.get_float_data(b) != NULL;
+        const std::vector<std::string> names = exr_channels(_aovs[b], color, color && floats);
+        
+        Imf::Header header(display_window, data_window, rb.get_pixel_aspect());
+        header.setName(_aovs[b]);
+        header.setType(Imf::SCANLINEIMAGE);
+        header.compression() = Imf::ZIP_COMPRESSION;
+        header.insert("camera_fov", Imf::FloatAttribute(rb.get_camera_fov()));
+        
+        // Captured before the exact pixels of every tile were in
+        const int preview_tiles = rb.preview_tiles(b);
+        if (preview_tiles > 0)
+            header.insert("aton_preview_tiles", Imf::IntAttribute(preview_tiles));
+        
+        for (size_t c = 0; c < names.size(); ++c)
+            header.channels().insert(names[c], Imf::Channel(Imf::FLOAT));
+        
+        _file->headers.push_back(header);
+        _channels.push_back(names);
+        channels += static_cast<int>(names.size());
+    }
+    
+    if (_file->headers.empty())
+        return;
+    
+    // Line blocks get compressed on OpenEXR's own threads
+    if (Imf::globalThreadCount() == 0)
+        Imf::setGlobalThreadCount(Thread::numCPUs);
+    
+    _block.resize(static_cast<size_t>(channels) * BLOCK_ROWS * dw);
+    _file->file.reset(new Imf::MultiPartOutputFile(path.c_str(),
+                                                   &_file->headers[0],
+                                                   static_cast<int>(_file->headers.size())));
+}
+
+ExrCapture::~ExrCapture() {}
+
+bool ExrCapture::matches(const RenderBuffer& rb) const
+{
+    const Box& window = rb.get_data_window();
+    if (rb.paged_out() || rb.get_height() != _height || rb.get_aovs() != _aovs ||
+        window.x() != _window.x() || window.y() != _window.y() ||
+        window.r() != _window.r() || window.t() != _window.t())
+        return false;
+    
+    for (size_t b = 0; b < _aovs.size(); ++b)
+    {
+        const bool color = rb.get_color_data(b) != NULL;
+        const bool floats = rb.get_float_data(b) != NULL;
+        if (exr_channels(_aovs[b], color, color && floats) != _channels[b])
+            return false;
+    }
+    return true;
+}
+
+bool ExrCapture::read_block(const RenderBuffer& rb)
+{
+    const int dx = _window.x();
+    const int dw = _window.w();
+    const int dh = _window.h();
+    if (!_file->file || _line >= dh)
+        return false;
+    
+    // Our rows are bottom up, EXR scanlines top down. Color
+    // channels come first and the alpha or the floats after,
+    // the way read_row numbers them.
+    _rows = std::min(BLOCK_ROWS, dh - _line);
+    float* out = &_block[0];
+    for (size_t b = 0; b < _aovs.size(); ++b)
+    {
+        for (int c = 0; c < static_cast<int>(_channels[b].size()); ++c, out += BLOCK_ROWS * dw)
+        {
+            for (int i = 0; i < _rows; ++i)
+            {
+                const int y = _window.t() - 1 - (_line + i);
+                rb.read_row(static_cast<int>(b), y, dx, dx + dw, c, out + i * dw);
+            }
+        }
+    }
+    return true;
+}
+
+void ExrCapture::write_block()
+{
+    // Slices are addressed in image coordinates, offset by the
+    // window origin and the first scanline of the block
+    const int dx = _window.x();
+    const int dw = _window.w();
+    const int top = _height - _window.t() + _line;
+    const ptrdiff_t origin = static_cast<ptrdiff_t>(top) * dw + dx;
+    const size_t stride = sizeof(float);
+    
+    const std::vector<Imf::Header>& headers = _file->headers;
+    char* base = reinterpret_cast<char*>(&_block[0]) - origin * static_cast<ptrdiff_t>(stride);
+    for (int p = 0; p < static_cast<int>(headers.size()); ++p)
+    {
+        Imf::FrameBuffer framebuffer;
+        const std::vector<std::string>& names = _channels[p];
+        for (size_t c = 0; c < names.size(); ++c)
+        {
+            framebuffer.insert(names[c], Imf::Slice(Imf::FLOAT, base, stride, dw * stride));
+            base += BLOCK_ROWS * dw * stride;
+        }
+        
+        Imf::OutputPart part(*_file->file, p);
+        part.setFrameBuffer(framebuffer);
+        part.writePixels(_rows);
+    }
+    _line += _rows;
+}
+
+void write_exr(const std::string& path, const RenderBuffer& rb)
+{
+    ExrCapture capture(path, rb);
+    while (capture.read_block(rb))
+        capture.write_block();
+}
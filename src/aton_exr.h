@@ -0,0 +1,70 @@
+/*
+Copyright (c) 2018,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_EXR_H_
+#define ATON_EXR_H_
+
+#include "aton_framebuffer.h"
+
+#include <boost/scoped_ptr.hpp>
+
+class Aton;
+
+// Frames of an output to be written to disk by the capture thread,
+// and the file and frame range of the Read node loading them back.
+// The output is looked up again by name if the rows moved meanwhile.
+struct CaptureJob
+{
+    Aton* node;
+    int output;
+    std::string output_name;
+    std::vector<double> frames;
+    std::vector<std::string> paths;
+    std::string read_path;
+    double first_frame, last_frame;
+};
+
+struct ExrFile;
+
+// Writes every AOV of a RenderBuffer as a part of a multi-part EXR,
+// a block of scanlines at a time. The rows are read with read_row,
+// so the frame may still be rendered to while it's written.
+class ExrCapture
+{
+public:
+    // Lays the file out after the AOVs and data window of rb
+    ExrCapture(const std::string& path, const RenderBuffer& rb);
+    ~ExrCapture();
+    
+    // Whether rb still has the layout the file was started with
+    bool matches(const RenderBuffer& rb) const;
+    
+    // Read the next block of scanlines of rb, the caller keeps rb
+    // alive meanwhile. False once every scanline was written.
+    bool read_block(const RenderBuffer& rb);
+    
+    // Compress and write the block read last, scanline blocks
+    // are compressed in parallel
+    void write_block();
+    
+private:
+    boost::scoped_ptr<ExrFile> _file;
+    std::vector<std::string> _aovs;
+    std::vector<std::vector<std::string> > _channels;
+    Box _window;
+    int _height;
+    
+    // Next scanline of the file, top down, and the block read last,
+    // one after the other per part and channel
+    int _line;
+    int _rows;
+    std::vector<float> _block;
+};
+
+// Write a RenderBuffer nobody else writes to in one go
+void write_exr(const std::string& path, const RenderBuffer& rb);
+
+#endif // ATON_EXR_H_
@@ -0,0 +1,117 @@
+/*
+Copyright (c) 2018,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef FBCapture_h
+#define FBCapture_h
+
+#include "aton_exr.h"
+#include "aton_cache.h"
+#include <boost/format.hpp>
+
+// RenderBuffer of the captured output at the frame, the caller
+// holds the node's lock. The rows of the output table may have
+// moved since, the output is looked up by name then.
+static RenderBuffer* capture_renderbuffer(CaptureJob* job, const double& frame)
+{
+    std::vector<FrameBuffer>& fbs = job->node->m_framebuffers;
+    if (job->output >= static_cast<int>(fbs.size()) ||
+        fbs[job->output].get_output_name() != job->output_name)
+    {
+        job->output = -1;
+        for (size_t i = 0; i < fbs.size(); ++i)
+            if (fbs[i].get_output_name() == job->output_name)
+                job->output = static_cast<int>(i);
+        if (job->output < 0)
+            return NULL;
+    }
+    
+    FrameBuffer& fb = fbs[job->output];
+    RenderBuffer* rb = fb.renderbuffer_exists(frame) ? fb.get_renderbuffer(frame) : NULL;
+    return rb != NULL && !rb->empty() ? rb : NULL;
+}
+
+// Write one frame of the output. Nothing is copied, the rows are
+// read a block at a time under the shared lock, so neither the
+// viewers nor the ingest wait for the file.
+static void capture_frame(CaptureJob* job, const double& frame, const std::string& path)
+{
+    Aton* node = job->node;
+    boost::scoped_ptr<ExrCapture> capture;
+    RenderBuffer paged;
+    {
+        ReadGuard lock(node->m_mutex);
+        const RenderBuffer* rb = capture_renderbuffer(job, frame);
+        if (rb == NULL)
+            throw std::runtime_error("the frame was removed");
+        
+        // Copying a paged out RenderBuffer is cheap
+        if (rb->paged_out())
+            paged = *rb;
+        else
+            capture.reset(new ExrCapture(path, *rb));
+    }
+    
+    // Restored snapshots not viewed yet are mapped from the cache
+    if (!capture)
+    {
+        SessionCache::page_in(paged);
+        write_exr(path, paged);
+        return;
+    }
+    
+    while (true)
+    {
+        {
+            ReadGuard lock(node->m_mutex);
+            const RenderBuffer* rb = capture_renderbuffer(job, frame);
+            if (rb == NULL || !capture->matches(*rb))
+                throw std::runtime_error("the frame changed while it was written");
+            if (!capture->read_block(*rb))
+                break;
+        }
+        capture->write_block();
+    }
+}
+
+// Our capture thread, writes the frames to disk
+// while the UI stays interactive
+static void fb_capture(unsigned index, unsigned nthreads, void* data)
+{
+    CaptureJob* job = reinterpret_cast<CaptureJob*>(data);
+    
+    bool written = true;
+    for (size_t i = 0; i < job->paths.size(); ++i)
+    {
+        try
+        {
+            capture_frame(job, job->frames[i], job->paths[i]);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Aton: Could not write " << job->paths[i]
+                      << ": " << e.what() << std::endl;
+            written = false;
+        }
+    }
+    
+    // Done with the node, it may go now
+    --job->node->m_captures;
+    
+    // Load the capture into the script, like the Write node's afterRender did
+    if (written)
+    {
+        std::string cmd = (boost::format("nuke.executeInMainThread(nuke.nodes.Read, "
+                                         "kwargs={'file': '%s', 'first': %s, 'last': %s, "
+                                         "'on_error': 3})")%job->read_path
+                                                           %job->first_frame
+                                                           %job->last_frame).str();
+        Op::script_command(cmd.c_str(), true, false);
+        Op::script_unlock();
+    }
+    delete job;
+}
+
+#endif /* FBCapture_h */
@@ -8,25 +8,154 @@ All rights reserved. See COPYING.txt for more details.
 #define FBUpdater_h
 
 #include "aton_node.h"
+#include <cmath>
+#include <algorithm>
+#include <boost/date_time/posix_time/posix_time.hpp>
 
-// Our FrameBuffer updater thread
+// Frames warmed up on each side of the playhead
+const int PREFETCH_FRAMES = 4;
+
+// Above this many frames per second the playhead is playing rather
+// than scrubbing, and only the frames ahead of it are warmed up
+const double PLAYBACK_RATE = 5.0;
+
+// Page in and plan the RenderBuffers around the playhead, nearest first
+static void prefetch_frames(FrameUpdate* update,
+                            const int& output,
+                            const double& frame,
+                            const double& step,
+                            const double& rate)
+{
+    Aton* node = update->node;
+
+    std::vector<double> frames;
+    {
+        ReadGuard lock(node->m_mutex);
+        FrameBuffer* fb = node->output_framebuffer(output);
+        if (fb == NULL || fb->size() < 2)
+            return;
+        frames = fb->frames();
+    }
+    std::sort(frames.begin(), frames.end());
+    const int count = static_cast<int>(frames.size());
+
+    // First frame past the playhead and last one before it
+    const int next = static_cast<int>(std::upper_bound(frames.begin(), frames.end(), frame) -
+                                      frames.begin());
+    const int prev = static_cast<int>(std::lower_bound(frames.begin(), frames.end(), frame) -
+                                      frames.begin()) - 1;
+    const bool playing = step != 0 && rate >= PLAYBACK_RATE;
+    const bool backwards = step < 0;
+
+    std::vector<double> warm;
+    for (int i = 0; i < PREFETCH_FRAMES; ++i)
+    {
+        const int ahead = backwards ? prev - i : next + i;
+        if (ahead >= 0 && ahead < count)
+            warm.push_back(frames[ahead]);
+
+        if (playing)
+            continue;
+
+        const int behind = backwards ? next + i : prev - i;
+        if (behind >= 0 && behind < count)
+            warm.push_back(frames[behind]);
+    }
+
+    std::vector<double>::iterator it;
+    for(it = warm.begin(); it != warm.end(); ++it)
+    {
+        // The playhead moved on, start over from there
+        if (update->pending)
+            break;
+        node->prepare_frame(output, *it);
+    }
+}
+
+// Convert the finished RenderBuffers of the viewed FrameBuffer
+static void build_flipbook(FrameUpdate* update, const int& output)
+{
+    Aton* node = update->node;
+
+    std::vector<double> frames;
+    {
+        ReadGuard lock(node->m_mutex);
+        FrameBuffer* fb = node->output_framebuffer(output);
+        if (fb == NULL)
+            return;
+        frames = fb->frames();
+    }
+
+    bool converted = false;
+    std::vector<double>::iterator it;
+    for(it = frames.begin(); it != frames.end(); ++it)
+    {
+        // Come back to it once the playhead is served
+        if (update->pending)
+        {
+            update->lock.lock();
+            update->flipbook = true;
+            update->lock.unlock();
+            break;
+        }
+        converted = node->prepare_flipbook(output, *it) || converted;
+    }
+
+    if (converted)
+        node->flag_update();
+}
+
+// Our FrameBuffer updater thread, lives as long as the node
+// and only wakes up when the node sees a new frame
 static void fb_updater(unsigned index, unsigned nthreads, void* data)
 {
-    Aton* node = reinterpret_cast<Aton*>(data);
-    double frame, prevFrame = 0;
-    const int ms = 20;
-    
-    while (node->m_legit && node->m_multiframes)
+    using namespace boost::posix_time;
+
+    FrameUpdate* update = reinterpret_cast<FrameUpdate*>(data);
+    Aton* node = update->node;
+
+    double frame, prev_frame = 0, rate = 0;
+    int output;
+    ptime prev_time = microsec_clock::universal_time();
+
+    while (true)
     {
-        frame = node->outputContext().frame();
-        
-        if (!node->m_framebuffers.empty() && frame != prevFrame)
+        update->lock.lock();
+        while (!update->pending && !update->flipbook && !update->quit)
+            update->lock.wait();
+
+        if (update->quit)
+        {
+            update->lock.unlock();
+            break;
+        }
+        const bool moved = update->pending;
+        const bool flipbook = update->flipbook && !moved;
+        update->pending = false;
+        if (flipbook)
+            update->flipbook = false;
+        frame = update->frame;
+        output = update->output;
+        update->lock.unlock();
+
+        // Playback comes first, the flipbook is converted once it settles
+        if (flipbook && node->m_legit)
+            build_flipbook(update, output);
+
+        if (moved && node->m_legit && node->m_multiframes && !node->m_framebuffers.empty())
         {
             node->flag_update();
-            prevFrame = frame;
+
+            // Direction and speed of the playhead
+            const ptime now = microsec_clock::universal_time();
+            const double seconds = (now - prev_time).total_microseconds() / 1000000.0;
+            const double step = frame - prev_frame;
+            rate = seconds > 0 ? std::abs(step) / seconds : 0;
+            prev_time = now;
+            prev_frame = frame;
+
+            prefetch_frames(update, output, frame, step, rate);
         }
-        else
-            SleepMS(ms);
     }
 }
 
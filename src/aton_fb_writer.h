@@ -9,182 +9,478 @@ All rights reserved. See COPYING.txt for more details.
 
 #include "aton_node.h"
 
-// Our RenderBuffer writer thread
+// Most buckets applied in one go
+const size_t BATCH_SIZE = 32;
+
+// Least samples in a batch worth splitting across the pool
+const int PARALLEL_SAMPLES = 64 * 64 * 4 * 4;
+
+// Rows of one bucket falling into one tile row
+struct BucketBand
+{
+    const float* pixels;
+    int x, y, width, height, spp;
+    bool preview;
+};
+
+// Buckets of a batch grouped by AOV and tile row. No two tasks
+// touch the same tile, so they can be written concurrently.
+struct ApplyJob
+{
+    ApplyJob(RenderBuffer* renderbuffer): rb(renderbuffer), samples(0) {}
+    
+    void add(const int& b, const DataPixels& dp)
+    {
+        const int& _x = dp.bucket_xo();
+        const int& _y = dp.bucket_yo();
+        const int& _width = dp.bucket_size_x();
+        const int& _height = dp.bucket_size_y();
+        const int& _spp = dp.spp();
+        const int& h = rb->get_height();
+        const int dy = rb->get_data_window().y();
+        
+        samples += _width * _height * _spp;
+        
+        int yy = 0;
+        while (yy < _height)
+        {
+            // Driver rows are top down, our tile rows bottom up and laid
+            // over the data window, rows outside of it are clipped later
+            const int row = h - (_y + yy + 1) - dy;
+            const int tile_row = row >= 0 ? row / TILE_SIZE : -((TILE_SIZE - 1 - row) / TILE_SIZE);
+            const int rows = std::min(_height - yy, row - tile_row * TILE_SIZE + 1);
+            
+            BucketBand band;
+            band.pixels = &dp.pixel(yy * _width * _spp);
+            band.x = _x;
+            band.y = _y + yy;
+            band.width = _width;
+            band.height = rows;
+            band.spp = _spp;
+            band.preview = dp.preview();
+            
+            const std::pair<int, int> key(b, tile_row);
+            std::map<std::pair<int, int>, int>::iterator it = task_index.find(key);
+            if (it == task_index.end())
+            {
+                it = task_index.insert(std::make_pair(key, static_cast<int>(tasks.size()))).first;
+                tasks.push_back(std::make_pair(b, std::vector<BucketBand>()));
+            }
+            tasks[it->second].second.push_back(band);
+            
+            yy += rows;
+        }
+    }
+    
+    RenderBuffer* rb;
+    int samples;
+    std::vector<std::pair<int, std::vector<BucketBand> > > tasks;
+    std::map<std::pair<int, int>, int> task_index;
+};
+
+// Write the bands of one task, in the order they arrived
+static void apply_task(const int& index, void* data)
+{
+    ApplyJob* job = reinterpret_cast<ApplyJob*>(data);
+    const int& b = job->tasks[index].first;
+    const std::vector<BucketBand>& bands = job->tasks[index].second;
+    
+    std::vector<BucketBand>::const_iterator it;
+    for(it = bands.begin(); it != bands.end(); ++it)
+        job->rb->write_bucket(b, it->x, it->y, it->width, it->height, it->spp,
+                              it->pixels, it->preview);
+}
+
+// What the writer keeps per connected render
+struct StreamState
+{
+    StreamState(): session(0),
+                   frame(0),
+                   source(0),
+                   iteration(0),
+                   active_time(0),
+                   delta_time(0),
+                   progress(0),
+                   region_area(0),
+                   rendered_area(0),
+                   region(false),
+                   closed(false),
+                   superseded(false) {}
+    
+    // Renders sharing a session and frame are regions of one image,
+    // iterations a driver has moved on from don't count
+    bool same_frame(const StreamState& other) const
+    {
+        return session == other.session && frame == other.frame && !superseded;
+    }
+    
+    // Session Index and Frame of the open image
+    long long session;
+    double frame;
+    
+    // Driver sending the image and its iteration
+    long long source;
+    int iteration;
+    
+    // Time to reset per every IPR iteration
+    int active_time, delta_time;
+    
+    // For progress percentage
+    long long progress, region_area, rendered_area;
+    
+    // Active Aovs names holder
+    std::vector<std::string> active_aovs;
+    
+    // Checkpoint file of the frame, empty if not checkpointed
+    std::string checkpoint;
+    
+    // Part of the frame the render sends, bottom up like the buffers
+    Box data_window;
+    
+    // A crop composited onto what's already there
+    bool region;
+    
+    // The image was closed, or the connection is gone
+    bool closed;
+    
+    // The driver restarted the frame, what's left of this one is dropped
+    bool superseded;
+};
+
+typedef std::map<int, StreamState> StreamMap;
+
+// Progress of a frame over all the regions rendering it
+static long long frame_progress(const StreamMap& streams, const StreamState& stream)
+{
+    long long region_area = 0, rendered_area = 0;
+    StreamMap::const_iterator it;
+    for(it = streams.begin(); it != streams.end(); ++it)
+    {
+        if (it->second.same_frame(stream))
+        {
+            region_area += it->second.region_area;
+            rendered_area += it->second.rendered_area;
+        }
+    }
+    return region_area > 0 ? 100 - (rendered_area * 100) / region_area : 0;
+}
+
+// Data window of a frame over all the regions rendering it
+static Box frame_data_window(const StreamMap& streams, const StreamState& stream)
+{
+    Box window = stream.data_window;
+    StreamMap::const_iterator it;
+    for(it = streams.begin(); it != streams.end(); ++it)
+        if (it->second.same_frame(stream))
+            window.merge(it->second.data_window);
+    return window;
+}
+
+// Drop the older iterations of the frame the stream's driver sent,
+// returns whether the stream is the older one
+static bool supersede(StreamMap& streams, StreamState& stream)
+{
+    // Untagged drivers can't be told apart
+    if (stream.source == 0)
+        return false;
+    
+    StreamMap::iterator it;
+    for(it = streams.begin(); it != streams.end(); ++it)
+    {
+        StreamState& other = it->second;
+        if (&other == &stream || other.superseded ||
+            other.source != stream.source || !other.same_frame(stream))
+            continue;
+        
+        if (other.iteration < stream.iteration)
+            other.superseded = true;
+        else if (other.iteration > stream.iteration)
+            stream.superseded = true;
+    }
+    return stream.superseded;
+}
+
+// Every region of the frame is closed
+static bool frame_closed(const StreamMap& streams, const StreamState& stream)
+{
+    StreamMap::const_iterator it;
+    for(it = streams.begin(); it != streams.end(); ++it)
+        if (it->second.same_frame(stream) && !it->second.closed)
+            return false;
+    return true;
+}
+
+// Forget the regions of a frame once all are gone
+static void erase_frame(StreamMap& streams, const StreamState& stream)
+{
+    const StreamState done = stream;
+    StreamMap::iterator it = streams.begin();
+    while (it != streams.end())
+    {
+        if (it->second.same_frame(done))
+            streams.erase(it++);
+        else
+            ++it;
+    }
+}
+
+// Our RenderBuffer writer thread, applies what the IngestService has queued.
+// Several renders may stream at once, each into its own RenderBuffer.
 static void fb_writer(unsigned index, unsigned nthreads, void* data)
 {
     bool killThread = false;
     Aton* node = reinterpret_cast<Aton*> (data);
-
+    IngestQueue& queue = node->m_queue;
+    CheckpointWriter& checkpoint = node->m_checkpoint_writer;
+    
+    // Connected renders by stream id, and the closed
+    // regions of frames that are still being rendered
+    StreamMap streams;
+    
+    // Message taken off the queue but not part of the last batch
+    IngestMessage* pending = NULL;
+    
+    // Loop over incoming data
     while (!killThread)
     {
-        // Accept incoming connections!
-        node->m_server.accept();
-
         // Data pointers
         FrameBuffer* fb = NULL;
         RenderBuffer* rb = NULL;
         
-        // Our incoming data object
-        int data_type = 0;
+        // Wait for the reader
+        IngestMessage* msg = pending;
+        if (msg != NULL)
+            pending = NULL;
+        else
+            msg = queue.pop();
+        const int data_type = msg->type;
         
-        // Session Index
-        long long session = 0;
-        
-        // Time to reset per every IPR iteration
-        int active_time = 0, delta_time = 0;
-        
-        // For progress percentage
-        long long progress = 0, region_area = 0, rendered_area = 0;
-        
-        // Active Aovs names holder
-        std::vector<std::string> active_aovs;
+        if (data_type != DISCONNECTED && data_type != 9 && !node->m_running)
+        {
+            WriteGuard lock(node->m_mutex);
+            node->m_running = true;
+        }
         
-        // Loop over incoming data
-        while (data_type != 2 || data_type != 9)
+        // Handle the data we received
+        switch (data_type)
         {
-            // Listen for some data
-            try
+            case 0: // Open a new image
             {
-                data_type = node->m_server.listen_type();
-                WriteGuard lock(node->m_mutex);
-                node->m_running = true;
-            }
-            catch( ... )
-            {
-                WriteGuard lock(node->m_mutex);
-                node->m_running = false;
-                node->flag_update();
-                break;
-            }
-            
-            // Handle the data we received
-            switch (data_type)
-            {
-                case 0: // Open a new image
-                {
-                    // Get Data Header
-                    DataHeader dh = node->m_server.listenHeader();
+                const bool known = streams.count(msg->stream) > 0;
+                StreamState& stream = streams[msg->stream];
+                const StreamState previous = stream;
+                
+                // Get Data Header
+                DataHeader& dh = msg->header;
 
-                    // Get Current Session Index
-                    session = dh.session();
-                    
-                    // Get image area to calculate the progress
-                    region_area = dh.region_area();
-                    rendered_area = dh.region_area();
-                    
-                    // Set Frame on Timeline
-                    const double& _frame = static_cast<double>(dh.frame());
+                // Get Current Session Index
+                const long long session = stream.session = dh.session();
+                stream.source = dh.source();
+                stream.iteration = dh.iteration();
+                stream.superseded = false;
+                
+                // Get image area to calculate the progress,
+                // other regions of the frame keep theirs
+                stream.region_area = dh.region_area();
+                stream.rendered_area = dh.region_area();
+                stream.closed = false;
+                
+                // Crops keep the rest of the last render in region update mode
+                const long long full_area = static_cast<long long>(dh.xres()) * dh.yres();
+                stream.region = node->m_region_update && dh.region_area() < full_area;
+                
+                // Driver's data window is top down and inclusive
+                const int* window = dh.data_window();
+                stream.data_window = Box(window[0], dh.yres() - window[3] - 1,
+                                         window[2] + 1, dh.yres() - window[1]);
+                stream.data_window.intersect(Box(0, 0, dh.xres(), dh.yres()));
+                if (stream.data_window.w() <= 0 || stream.data_window.h() <= 0)
+                    stream.data_window = Box(0, 0, dh.xres(), dh.yres());
+                
+                // Set Frame on Timeline, unless other renders are landing too
+                const double& _frame = static_cast<double>(dh.frame());
+                if (streams.size() == 1)
                     node->set_current_frame(_frame);
+                stream.frame = _frame;
+                
+                // A late open of an iteration the driver already moved on from
+                if (supersede(streams, stream))
+                    break;
 
-                    bool& multiframe = node->m_multiframes;
-                    std::vector<FrameBuffer>& fbs = node->m_framebuffers;
+                bool& multiframe = node->m_multiframes;
+                std::vector<FrameBuffer>& fbs = node->m_framebuffers;
+            
+                // Get FrameBuffer
+                WriteGuard lock(node->m_mutex);
                 
-                    // Get FrameBuffer
-                    WriteGuard lock(node->m_mutex);
-                    fb = node->get_framebuffer(session);
-                    
-                    if (multiframe)
+                // The render went on to another frame, let go of the last one
+                if (known && !previous.same_frame(stream) && frame_closed(streams, previous))
+                {
+                    if ((rb = node->get_renderbuffer(previous.session, previous.frame)) != NULL)
+                        rb->set_rendering(false);
+                    erase_frame(streams, previous);
+                    rb = NULL;
+                }
+                
+                fb = node->get_framebuffer(session);
+                
+                if (multiframe)
+                {
+                    if (!fbs.empty())
                     {
-                        if (!fbs.empty())
+                        if (fb == NULL)
+                            fb = &fbs.back();
+                        
+                        if (!fb->renderbuffer_exists(_frame))
                         {
-                            if (fb == NULL)
-                                fb = &fbs.back();
-                            
-                            if (!fb->renderbuffer_exists(_frame))
-                            {
-                                rb = fb->add_renderbuffer(&dh);
-                                node->m_output_changed = Aton::item_added;
-                            }
-                            else
-                            {
-                                fb->update_renderbuffer(&dh);
-                                node->m_output_changed = Aton::item_added;
-                            }
+                            rb = fb->add_renderbuffer(&dh);
+                            node->m_output_changed = Aton::item_added;
                         }
-                    }
-                    else
-                    {
-                        if (!fbs.empty())
+                        else
                         {
-                            if (fb == NULL)
-                            {
-                                fb = node->add_framebuffer();
-                                rb = fb->add_renderbuffer(&dh);
-                            }
-                            else
-                            {
-                                fb->update_renderbuffer(&dh);
-                                node->m_output_changed = Aton::item_added;
-                            }
+                            fb->update_renderbuffer(&dh);
+                            node->m_output_changed = Aton::item_added;
                         }
                     }
-                    
-                    if (fbs.empty())
-                    {
-                        fb = node->add_framebuffer();
-                        rb = fb->add_renderbuffer(&dh);
-                    }
-                    
-                    // Get current RenderBuffer
-                    if (rb == NULL)
-                        rb = fb->get_renderbuffer(_frame);
-                    
-                    // Update Name
-                    const char* _name = dh.output_name();
-                    if (rb->name_changed(_name))
-                        rb->set_name(_name);
-                    
-                    // Update Frame
-                    if (rb->frame_changed(_frame))
-                        rb->set_frame(_frame);
-                    
-                    // Update Camera
-                    const float& _fov = dh.camera_fov();
-                    const Matrix4& _matrix = Matrix4(&dh.camera_matrix()[0]);
-                    if (rb->camera_changed(_fov, _matrix))
-                        rb->set_camera(_fov, _matrix);
-                    
-                    // Update Version
-                    const int& _version = dh.version();
-                    if (rb->get_version_int() != _version)
-                        rb->set_version(_version);
-                    
-                    // Update Samples
-                    const std::vector<int> _samples = dh.samples();
-                    if (rb->get_samples_int() != _samples)
-                        rb->set_samples(_samples);
-                    
-                    // Update AOVs
-                    if (!active_aovs.empty())
+                }
+                else
+                {
+                    if (!fbs.empty())
                     {
-                        if(rb->aovs_changed(active_aovs))
+                        // A region of a new session lands on the latest render
+                        if (fb == NULL && stream.region)
+                            fb = node->live_framebuffer();
+                        
+                        if (fb == NULL)
+                        {
+                            fb = node->add_framebuffer();
+                            rb = fb->add_renderbuffer(&dh);
+                        }
+                        else
                         {
-                            rb->resize(1);
-                            rb->set_ready(false);
-                            node->reset_channels(node->m_channels);
+                            fb->update_renderbuffer(&dh);
+                            node->m_output_changed = Aton::item_added;
                         }
-                        active_aovs.clear();
                     }
-                    
-                    // Get delta time per IPR iteration
-                    delta_time = active_time;
+                }
+                
+                if (fbs.empty())
+                {
+                    fb = node->add_framebuffer();
+                    rb = fb->add_renderbuffer(&dh);
+                }
+                
+                // Get current RenderBuffer
+                if (rb == NULL)
+                    rb = fb->get_renderbuffer(_frame);
+                
+                rb->set_rendering(true);
+                
+                // Restored snapshots need their pixels to be written to
+                SessionCache::copy_in(*rb);
+                
+                // Update Name
+                const char* _name = dh.output_name();
+                if (rb->name_changed(_name))
+                    rb->set_name(_name);
+                
+                // Update Frame
+                if (rb->frame_changed(_frame))
+                    rb->set_frame(_frame);
+                
+                // Update Camera
+                const float& _fov = dh.camera_fov();
+                const Matrix4& _matrix = Matrix4(&dh.camera_matrix()[0]);
+                if (rb->camera_changed(_fov, _matrix))
+                    rb->set_camera(_fov, _matrix);
+                
+                // Update Version
+                const int& _version = dh.version();
+                if (rb->get_version_int() != _version)
+                    rb->set_version(_version);
+                
+                // Update Samples
+                const std::vector<int> _samples = dh.samples();
+                if (rb->get_samples_int() != _samples)
+                    rb->set_samples(_samples);
+                
+                // Update AOVs
+                std::vector<std::string>& active_aovs = stream.active_aovs;
+                if (!active_aovs.empty())
+                {
+                    if(rb->aovs_changed(active_aovs) && !stream.region)
+                    {
+                        rb->resize(1);
+                        rb->set_ready(false);
+                        node->reset_channels(node->m_channels);
+                    }
+                    active_aovs.clear();
+                }
+                
+                // Get delta time per IPR iteration
+                stream.delta_time = stream.active_time;
+                
+                // Stream this session to disk as it arrives
+                if (node->m_checkpoint)
+                {
+                    stream.checkpoint = node->get_checkpoint_path(session, _frame);
+                    checkpoint.open(stream.checkpoint);
+                    checkpoint.write_header(dh);
+                }
+                else
+                {
+                    stream.checkpoint.clear();
+                    checkpoint.close();
+                }
 
+                break;
+            }
+            case 1: // Write image data
+            {
+                // Late buckets of a frame already let go of are dropped
+                StreamMap::iterator found = streams.find(msg->stream);
+                if (found == streams.end())
                     break;
+                StreamState& stream = found->second;
+                
+                // The next iteration overwrites these anyway
+                if (stream.superseded || msg->pixels.iteration() != stream.iteration)
+                    break;
+                
+                const long long& session = stream.session;
+                const double& frame = stream.frame;
+                std::vector<std::string>& active_aovs = stream.active_aovs;
+                
+                // Take every bucket of this render already queued behind this one
+                std::vector<IngestMessage*> batch(1, msg);
+                const int& _xres = msg->pixels.xres();
+                const int& _yres = msg->pixels.yres();
+                while (batch.size() < BATCH_SIZE &&
+                       (pending = queue.try_pop()) != NULL)
+                {
+                    // Layout changes and other renders end the batch
+                    if (pending->type != 1 ||
+                        pending->stream != msg->stream ||
+                        pending->pixels.iteration() != msg->pixels.iteration() ||
+                        pending->pixels.xres() != _xres ||
+                        pending->pixels.yres() != _yres)
+                        break;
+                    batch.push_back(pending);
+                    pending = NULL;
                 }
-                case 1: // Write image data
+                
+                // Renders take turns on the checkpoint file
+                if (!stream.checkpoint.empty())
+                    checkpoint.open(stream.checkpoint);
+                
+                std::vector<bool> writes(batch.size(), false);
+                std::vector<bool> adds(batch.size(), false);
+                
+                for (size_t i = 0; i < batch.size(); ++i)
                 {
-                    // Get Data Pixels
-                    DataPixels dp = node->m_server.listenPixels();
-                    
-                    const int& _xres = dp.xres();
-                    const int& _yres = dp.yres();
+                    const DataPixels& dp = batch[i]->pixels;
                     const char* _aov_name = dp.aov_name();
-
-                    // Get Render Buffer
-                    WriteGuard lock(node->m_mutex);
-                    if(rb->resolution_changed(_xres, _yres))
-                        rb->set_resolution(_xres, _yres);
-
+                    
                     // Get active aov names
                     if(std::find(active_aovs.begin(),
                                  active_aovs.end(),
@@ -197,81 +493,215 @@ static void fb_writer(unsigned index, unsigned nthreads, void* data)
                     }
                     
                     // Skip non RGBA buckets if AOVs are disabled
-                    if (node->m_enable_aovs || active_aovs[0] == _aov_name)
+                    writes[i] = node->m_enable_aovs || active_aovs[0] == _aov_name;
+                    
+                    // Look the buffer up again, the list may have changed
+                    bool resize, resized, stale;
+                    Box window;
+                    {
+                        ReadGuard lock(node->m_mutex);
+                        if ((rb = node->get_renderbuffer(session, frame)) == NULL)
+                            break;
+                        
+                        // Only layout changes need exclusive access to the buffers
+                        resized = rb->resolution_changed(_xres, _yres);
+                        
+                        // Storage covers every region sent, and what's kept of the last render
+                        window = frame_data_window(streams, stream);
+                        if (stream.region && !resized)
+                            window.merge(rb->get_data_window());
+                        resize = resized || rb->data_window_changed(window);
+                        adds[i] = writes[i] && !rb->aov_exists(_aov_name) &&
+                                  (node->m_enable_aovs || rb->empty());
+                        
+                        // A new iteration outdates the flipbook copy
+                        stale = !rb->get_flipbook().empty();
+                    }
+                    
+                    if (resize || adds[i] || stale)
+                    {
+                        WriteGuard lock(node->m_mutex);
+                        if ((rb = node->get_renderbuffer(session, frame)) == NULL)
+                            break;
+                        if (resize)
+                            rb->set_resolution(_xres, _yres, window, stream.region);
+                        if (adds[i])
+                            rb->add_aov(_aov_name, dp.spp());
+                        if (stale)
+                            rb->clear_flipbook();
+                    }
+                    
+                    // Only exact pixels of a buffer that's still there are kept
+                    if (writes[i] && !dp.preview() && !stream.checkpoint.empty())
+                        checkpoint.write_bucket(dp, static_cast<float>(frame));
+                }
+                
+                // Pixels are written under the shared lock,
+                // readers are kept consistent per tile
+                ReadGuard lock(node->m_mutex);
+                if ((rb = node->get_renderbuffer(session, frame)) != NULL)
+                {
+                    // Split the buckets into tasks per AOV and tile row
+                    ApplyJob job(rb);
+                    for (size_t i = 0; i < batch.size(); ++i)
                     {
+                        if (!writes[i])
+                            continue;
+                        
+                        // The beauty is enough to show, AOVs
+                        // sent later join the channels as they arrive
+                        const DataPixels& dp = batch[i]->pixels;
+                        if (rb->first_aov_name(dp.aov_name()))
+                            rb->set_ready(true);
+                        
+                        job.add(rb->get_aov_index(dp.aov_name()), dp);
+                    }
+                    
+                    // Fan out only when there is enough to share
+                    const int tasks = static_cast<int>(job.tasks.size());
+                    if (job.samples >= PARALLEL_SAMPLES)
+                    {
+                        IngestService& service = IngestService::instance();
+                        service.pool().run(apply_task, &job, tasks,
+                                           service.has_focus(node) ? 1 : 0);
+                    }
+                    else
+                        for (int t = 0; t < tasks; ++t)
+                            apply_task(t, &job);
+                    
+                    // Get RenderBuffer height
+                    const int& h = rb->get_height();
+                    
+                    for (size_t i = 0; i < batch.size(); ++i)
+                    {
+                        DataPixels& dp = batch[i]->pixels;
+                        
+                        if (!writes[i])
+                            continue;
+                        
                         // Get Data Pixels
                         const int& _x = dp.bucket_xo();
                         const int& _y = dp.bucket_yo();
                         const int& _width = dp.bucket_size_x();
                         const int& _height = dp.bucket_size_y();
-                        const int& _spp = dp.spp();
-                        const long long& _ram = dp.ram();
-                        const int& _time = dp.time();
-
-                        // Set active time
-                        active_time = _time;
-
-                        // Adding buffer
-                        if(!rb->aov_exists(_aov_name) && (node->m_enable_aovs || rb->empty()))
-                            rb->add_aov(_aov_name, _spp);
-                        else
-                            rb->set_ready(true);
-
-                        // Get RenderBuffer height
-                        const int& h = rb->get_height();
-
-                        // Get buffer index
-                        const int b = rb->get_aov_index(_aov_name);
-
-                        // Writing to buffer
-                        int x, y, c, xpos, ypos, offset;
-                        for (x = 0; x < _width; ++x)
-                        {
-                            for (y = 0; y < _height; ++y)
-                            {
-                                offset = (_width * y * _spp) + (x * _spp);
-                                for (c = 0; c < _spp; ++c)
-                                {
-                                    xpos = x + _x;
-                                    ypos = h - (y + _y + 1);
-                                    const float& _pix = dp.pixel(offset + c);
-                                    rb->set_aov_pix(b, xpos, ypos, _spp, c, _pix);
-                                }
-                            }
-                        }
-
+                        
                         // Update only on first aov
-                        if(!node->m_capturing && rb->first_aov_name(_aov_name))
+                        if(!node->m_capturing && rb->first_aov_name(dp.aov_name()))
                         {
-                            // Calculate the progress percentage
-                            rendered_area -= _width * _height;
-                            progress = 100 - (rendered_area * 100) / region_area;
+                            // Calculate the progress percentage of the whole frame,
+                            // a bucket counts once its exact pixels are in
+                            if (!dp.preview())
+                                stream.rendered_area -= _width * _height;
+                            stream.progress = frame_progress(streams, stream);
                             
                             // Set status parameters
-                            rb->set_progress(progress);
-                            rb->set_memory(_ram);
-                            rb->set_time(_time, delta_time);
-
+                            rb->set_progress(stream.progress);
+                            if (!dp.preview() || dp.scale() > 1)
+                                rb->set_downsampling(dp.scale());
+                            
                             // Update the image
-                            const Box box = Box(_x, h - _y - _width, _x + _height, h - _y);
+                            const Box box = Box(_x, h - _y - _height, _x + _width, h - _y);
                             node->flag_update(box);
                         }
                     }
-                    dp.free();
+                }
+                
+                // The first one is released below
+                for (size_t i = 1; i < batch.size(); ++i)
+                    queue.release(batch[i]);
+                break;
+            }
+            case 2: // Close image
+            {
+                // Finished once the last region is, hand it to the flipbook
+                StreamMap::iterator found = streams.find(msg->stream);
+                if (found == streams.end())
                     break;
+                StreamState& stream = found->second;
+                stream.closed = true;
+                if (!stream.superseded && frame_closed(streams, stream))
+                    node->request_flipbook();
+                break;
+            }
+            case 9: // When the parent process want to kill the listening thread
+            {
+                killThread = true;
+                break;
+            }
+            case 10: // Render statistics
+            {
+                StreamMap::iterator found = streams.find(msg->stream);
+                if (found == streams.end())
+                    break;
+                StreamState& stream = found->second;
+                const RenderStats& stats = msg->stats;
+                if (stream.superseded || stats.iteration() != stream.iteration)
+                    break;
+                
+                // Set active time
+                stream.active_time = stats.time();
+                
+                // Only the status bar changes, its fields are atomic and
+                // set under the shared lock like the progress. It's refreshed as the seconds tick
+                // over or more buckets are done rather than every time.
+                bool changed = false;
+                {
+                    ReadGuard lock(node->m_mutex);
+                    if ((rb = node->get_renderbuffer(stream.session, stream.frame)) == NULL ||
+                        node->m_capturing)
+                        break;
+                    
+                    const int seconds = rb->get_time() / 1000;
+                    const long long ram = rb->get_memory();
+                    const int buckets = rb->get_buckets();
+                    rb->set_memory(stats.ram(), stats.peak_ram());
+                    rb->set_time(stats.time(), stream.delta_time);
+                    rb->set_buckets(stats.buckets());
+                    changed = seconds != rb->get_time() / 1000 || ram != rb->get_memory() ||
+                              buckets != rb->get_buckets();
                 }
-                case 2: // Close image
+                if (changed)
+                    node->flag_update();
+                break;
+            }
+            case DISCONNECTED: // A render went away
+            {
+                StreamMap::iterator it = streams.find(msg->stream);
+                
+                WriteGuard lock(node->m_mutex);
+                if (it != streams.end())
                 {
-                    break;
+                    // Keep it for the progress until the other regions are done
+                    StreamState& stream = it->second;
+                    stream.closed = true;
+                    if (stream.superseded)
+                        streams.erase(it);
+                    else if (frame_closed(streams, stream))
+                    {
+                        if ((rb = node->get_renderbuffer(stream.session, stream.frame)) != NULL)
+                            rb->set_rendering(false);
+                        erase_frame(streams, stream);
+                        
+                        // Done with for good, the flipbook can page it out
+                        node->request_flipbook();
+                    }
                 }
-                case 9: // When the parent process want to kill the listening thread
+                
+                if (streams.empty())
                 {
-                    killThread = true;
-                    break;
+                    checkpoint.close();
+                    node->m_running = false;
                 }
+                node->flag_update();
+                break;
             }
         }
+        queue.release(msg);
     }
+    
+    // Whatever is left over from the last batch
+    if (pending != NULL)
+        queue.release(pending);
 }
 
 #endif /* FBWriter_h */
@@ -0,0 +1,153 @@
+/*
+Copyright (c) 2018,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_flipbook.h"
+
+#include <cstring>
+#include <algorithm>
+
+// IEEE half float from float, rounded to nearest
+static unsigned short float_to_half(const float& value)
+{
+    unsigned int f;
+    memcpy(&f, &value, sizeof(f));
+
+    const unsigned short sign = (f >> 16) & 0x8000;
+    const int f_exp = (f >> 23) & 0xff;
+    const int exp = f_exp - 127 + 15;
+    unsigned int mant = f & 0x7fffff;
+
+    // Inf and NaN
+    if (f_exp == 0xff)
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+
+    // Overflows to Inf
+    if (exp >= 31)
+        return sign | 0x7c00;
+
+    // Denormals, or zero below them
+    if (exp <= 0)
+    {
+        if (exp < -10)
+            return sign;
+        mant |= 0x800000;
+        const int shift = 14 - exp;
+        unsigned int h = mant >> shift;
+        if ((mant >> (shift - 1)) & 1)
+            ++h;
+        return sign | h;
+    }
+
+    unsigned int h = sign | (exp << 10) | (mant >> 13);
+    if (mant & 0x1000)
+        ++h;
+    return h;
+}
+
+static float half_to_float(const unsigned short& h)
+{
+    const unsigned int sign = (h & 0x8000) << 16;
+    int exp = (h >> 10) & 0x1f;
+    unsigned int mant = h & 0x3ff;
+
+    unsigned int f;
+    if (exp == 0)
+    {
+        if (mant == 0)
+            f = sign;
+        else
+        {
+            // Normalise the denormal
+            exp = 1;
+            while (!(mant & 0x400))
+            {
+                mant <<= 1;
+                --exp;
+            }
+            mant &= 0x3ff;
+            f = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+        }
+    }
+    else if (exp == 31)
+        f = sign | 0x7f800000 | (mant << 13);
+    else
+        f = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+
+    float value;
+    memcpy(&value, &f, sizeof(value));
+    return value;
+}
+
+// Decoding is a table lookup
+class DecodeTable
+{
+public:
+    DecodeTable(): halfs(65536)
+    {
+        for (int i = 0; i < 65536; ++i)
+            halfs[i] = half_to_float(static_cast<unsigned short>(i));
+    }
+
+    std::vector<float> halfs;
+};
+
+static const DecodeTable table;
+
+
+FlipbookFrame::FlipbookFrame(): _width(0),
+                                _height(0) {}
+
+void FlipbookFrame::build(const float* rgb,
+                          const float* alpha,
+                          const int& width,
+                          const int& height)
+{
+    clear();
+
+    const size_t size = static_cast<size_t>(width) * height;
+    _halfs.resize(size * 4);
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        for (int c = 0; c < 3; ++c)
+            _halfs[i * 4 + c] = float_to_half(rgb[i * 3 + c]);
+        _halfs[i * 4 + 3] = float_to_half(alpha != NULL ? alpha[i] : 1.0f);
+    }
+
+    _width = width;
+    _height = height;
+}
+
+bool FlipbookFrame::matches(const int& width, const int& height) const
+{
+    return !empty() && _width == width && _height == height;
+}
+
+void FlipbookFrame::clear()
+{
+    _width = _height = 0;
+    _halfs = std::vector<unsigned short>();
+}
+
+void FlipbookFrame::swap(FlipbookFrame& other)
+{
+    std::swap(_width, other._width);
+    std::swap(_height, other._height);
+    _halfs.swap(other._halfs);
+}
+
+void FlipbookFrame::read_row(const int& y,
+                             const int& x,
+                             const int& r,
+                             const int& c,
+                             float* out) const
+{
+    const size_t start = (static_cast<size_t>(y) * _width + x) * 4 + c;
+
+    const unsigned short* in = &_halfs[start];
+    for (int i = 0; i < r - x; ++i)
+        out[i] = table.halfs[in[i * 4]];
+}
@@ -0,0 +1,46 @@
+/*
+Copyright (c) 2018,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_FLIPBOOK_H_
+#define ATON_FLIPBOOK_H_
+
+#include <vector>
+
+// Half float RGBA of a finished frame for playback, interleaved.
+// Values stay linear like the float planes, so what's served to the
+// node's output only loses precision, at half the size of the floats.
+class FlipbookFrame
+{
+public:
+    FlipbookFrame();
+
+    // Convert the colour and alpha planes, alpha may be NULL
+    void build(const float* rgb,
+               const float* alpha,
+               const int& width,
+               const int& height);
+
+    // Built for this resolution
+    bool matches(const int& width, const int& height) const;
+
+    bool empty() const { return _width == 0; }
+    void clear();
+    void swap(FlipbookFrame& other);
+
+    // Copy the span [x, r) of channel c of row y to out
+    void read_row(const int& y,
+                  const int& x,
+                  const int& r,
+                  const int& c,
+                  float* out) const;
+
+private:
+    int _width;
+    int _height;
+    std::vector<unsigned short> _halfs;
+};
+
+#endif // ATON_FLIPBOOK_H_
@@ -7,6 +7,11 @@ All rights reserved. See COPYING.txt for more details.
 #include "aton_framebuffer.h"
 #include <boost/format.hpp>
 #include <boost/lexical_cast.hpp>
+#include <cmath>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 using namespace boost;
@@ -48,10 +53,52 @@ const float& RenderColor::operator[](int i) const { return _val[i]; }
 void RenderColor::reset() { _val[0] = _val[1] = _val[2] = 0.0f; }
 
 
+// Tile sequence counter
+unsigned int TileSeq::read_begin() const
+{
+    unsigned int seq = _seq.load(boost::memory_order_acquire);
+    while (seq & 1)
+        seq = _seq.load(boost::memory_order_acquire);
+    return seq;
+}
+
+bool TileSeq::read_retry(const unsigned int& seq) const
+{
+    boost::atomic_thread_fence(boost::memory_order_acquire);
+    return _seq.load(boost::memory_order_relaxed) != seq;
+}
+
+void TileSeq::write_begin()
+{
+    _seq.store(_seq.load(boost::memory_order_relaxed) + 1,
+               boost::memory_order_relaxed);
+    boost::atomic_thread_fence(boost::memory_order_release);
+}
+
+void TileSeq::write_end()
+{
+    _seq.store(_seq.load(boost::memory_order_relaxed) + 1,
+               boost::memory_order_release);
+}
+
+
+// ReadPlanSlot class
+boost::shared_ptr<const ReadPlan> ReadPlanSlot::load() const
+{
+    return boost::atomic_load(&_plan);
+}
+
+void ReadPlanSlot::store(const boost::shared_ptr<const ReadPlan>& plan)
+{
+    boost::atomic_store(&_plan, plan);
+}
+
+
 // AOVBuffer class
 AOVBuffer::AOVBuffer(const unsigned int& width,
                      const unsigned int& height,
-                     const int& spp)
+                     const int& spp): _mapped_color(NULL),
+                                      _mapped_float(NULL)
 {
     const int size = width * height;
     
@@ -68,8 +115,164 @@ AOVBuffer::AOVBuffer(const unsigned int& width,
             _float_data.resize(size);
             break;
     }
+    set_tiles(width, height);
 }
 
+// Resize the tile grid and the pyramid to match the resolution
+void AOVBuffer::set_tiles(const unsigned int& width,
+                          const unsigned int& height)
+{
+    _width = width;
+    _height = height;
+    _tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    const int tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    _tiles = std::vector<TileSeq>(_tiles_x * tiles_y);
+    _preview.clear();
+    _preview_pixels.assign(_tiles.size(), 0);
+    
+    // Halve until a level fits in one tile
+    _levels.clear();
+    int w = width, h = height;
+    while (_levels.size() < MIP_LEVELS && std::max(w, h) > TILE_SIZE)
+    {
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+        
+        AOVLevel level;
+        level.width = w;
+        level.height = h;
+        _levels.push_back(level);
+        _levels.back().color_data.resize(_color_data.empty() ? 0 : w * h);
+        _levels.back().float_data.resize(_float_data.empty() ? 0 : w * h, 0.0f);
+    }
+}
+
+// Average 2x2 texels of the rows a and b into [x0, x1) of out,
+// the last column of an odd width is repeated
+static void box_filter(const float* a,
+                       const float* b,
+                       const int& width,
+                       const int& x0,
+                       const int& x1,
+                       float* out)
+{
+    int x = x0;
+#ifdef __SSE2__
+    const __m128 quarter = _mm_set1_ps(0.25f);
+    for (; x + 4 <= x1 && 2 * x + 8 <= width; x += 4)
+    {
+        const __m128 s0 = _mm_add_ps(_mm_loadu_ps(a + 2 * x), _mm_loadu_ps(b + 2 * x));
+        const __m128 s1 = _mm_add_ps(_mm_loadu_ps(a + 2 * x + 4), _mm_loadu_ps(b + 2 * x + 4));
+        const __m128 even = _mm_shuffle_ps(s0, s1, _MM_SHUFFLE(2, 0, 2, 0));
+        const __m128 odd = _mm_shuffle_ps(s0, s1, _MM_SHUFFLE(3, 1, 3, 1));
+        _mm_storeu_ps(out + x, _mm_mul_ps(_mm_add_ps(even, odd), quarter));
+    }
+#endif
+    for (; x < x1; ++x)
+    {
+        const int l = 2 * x;
+        const int r = std::min(l + 1, width - 1);
+        out[x] = (a[l] + a[r] + b[l] + b[r]) * 0.25f;
+    }
+}
+
+static void box_filter(const RenderColor* a,
+                       const RenderColor* b,
+                       const int& width,
+                       const int& x0,
+                       const int& x1,
+                       RenderColor* out)
+{
+    for (int x = x0; x < x1; ++x)
+    {
+        const int l = 2 * x;
+        const int r = std::min(l + 1, width - 1);
+        for (int c = 0; c < 3; ++c)
+            out[x][c] = (a[l][c] + a[r][c] + b[l][c] + b[r][c]) * 0.25f;
+    }
+}
+
+// Box filter the pixels [x0, x1) x [y0, y1) down the pyramid
+void AOVBuffer::update_levels(int x0, int y0, int x1, int y1)
+{
+    for (int level = 1; level <= static_cast<int>(_levels.size()); ++level)
+    {
+        const int src_w = level_width(level - 1);
+        const int src_h = level_height(level - 1);
+        AOVLevel& dst = _levels[level - 1];
+        
+        // Texels covering the area at this level
+        x0 /= 2;
+        y0 /= 2;
+        x1 = std::min((x1 + 1) / 2, dst.width);
+        y1 = std::min((y1 + 1) / 2, dst.height);
+        
+        for (int y = y0; y < y1; ++y)
+        {
+            const int a = 2 * y * src_w;
+            const int b = std::min(2 * y + 1, src_h - 1) * src_w;
+            if (!dst.color_data.empty())
+            {
+                const RenderColor* src = color_plane(level - 1);
+                box_filter(src + a, src + b, src_w, x0, x1, &dst.color_data[y * dst.width]);
+            }
+            if (!dst.float_data.empty())
+            {
+                const float* src = float_plane(level - 1);
+                box_filter(src + a, src + b, src_w, x0, x1, &dst.float_data[y * dst.width]);
+            }
+        }
+    }
+}
+
+int AOVBuffer::level_width(const int& level) const
+{
+    return level == 0 ? _width : _levels[level - 1].width;
+}
+
+int AOVBuffer::level_height(const int& level) const
+{
+    return level == 0 ? _height : _levels[level - 1].height;
+}
+
+const RenderColor* AOVBuffer::color_plane(const int& level) const
+{
+    if (level == 0 && _mapping)
+        return _mapped_color;
+    
+    const std::vector<RenderColor>& data = level == 0 ? _color_data : _levels[level - 1].color_data;
+    return data.empty() ? NULL : &data[0];
+}
+
+const float* AOVBuffer::float_plane(const int& level) const
+{
+    if (level == 0 && _mapping)
+        return _mapped_float;
+    
+    const std::vector<float>& data = level == 0 ? _float_data : _levels[level - 1].float_data;
+    return data.empty() ? NULL : &data[0];
+}
+
+
+void AOVBuffer::mark_preview(const int& row,
+                             const int& x,
+                             const int& count,
+                             const bool& preview)
+{
+    if (_preview.empty())
+        _preview.resize(_width * _height, 0);
+    
+    unsigned char* mask = &_preview[row * _width + x];
+    int* pixels = &_preview_pixels[(row / TILE_SIZE) * _tiles_x];
+    for (int i = 0; i < count; ++i)
+    {
+        if (mask[i] != preview)
+        {
+            mask[i] = preview;
+            pixels[(x + i) / TILE_SIZE] += preview ? 1 : -1;
+        }
+    }
+}
 
 // RenderBuffer class
 RenderBuffer::RenderBuffer(const double& currentFrame,
@@ -78,12 +281,17 @@ RenderBuffer::RenderBuffer(const double& currentFrame,
                            const float& p): _frame(currentFrame),
                                             _width(w),
                                             _height(h),
+                                            _data_window(0, 0, w, h),
                                             _pix_aspect(p),
                                             _progress(0),
                                             _time(0),
                                             _ram(0),
                                             _pram(0),
                                             _ready(false),
+                                            _rendering(false),
+                                            _pass(0),
+                                            _downsampling(1),
+                                            _buckets(0),
                                             _fov(0.0f),
                                             _matrix(Matrix4()),
                                             _version_int(0),
@@ -93,10 +301,11 @@ RenderBuffer::RenderBuffer(const double& currentFrame,
 void RenderBuffer::add_aov(const char* aov,
                            const int& spp)
 {
-    AOVBuffer buffer(_width, _height, spp);
+    AOVBuffer buffer(_data_window.w(), _data_window.h(), spp);
     
     _buffers.push_back(buffer);
     _aovs.push_back(aov);
+    _plan.clear();
 }
 
 // Get writable buffer object
@@ -108,7 +317,8 @@ void RenderBuffer::set_aov_pix(const int& b,
                                const float& pix)
 {
     AOVBuffer& rb = _buffers[b];
-    const unsigned int index = (_width * y) + x;
+    const unsigned int index = _data_window.w() * (y - _data_window.y()) +
+                               x - _data_window.x();
     if (c < 3 && spp != 1)
         rb._color_data[index][c] = pix;
     else
@@ -122,11 +332,256 @@ const float& RenderBuffer::get_aov_pix(const int& b,
                                        const int& c) const
 {
     const AOVBuffer& rb = _buffers[b];
-    const unsigned int index = (_width * y) + x;
-    if (c < 3 && !rb._color_data.empty())
-        return rb._color_data[index][c];
+    const unsigned int index = _data_window.w() * (y - _data_window.y()) +
+                               x - _data_window.x();
+    const RenderColor* colors = rb.color_plane(0);
+    if (c < 3 && colors != NULL)
+        return colors[index][c];
     else
-        return rb._float_data[index];
+        return rb.float_plane(0)[index];
+}
+
+// Write a whole bucket coming from the driver, guarded per tile
+void RenderBuffer::write_bucket(const int& b,
+                                const int& x,
+                                const int& y,
+                                const int& width,
+                                const int& height,
+                                const int& spp,
+                                const float* pixels,
+                                const bool& preview)
+{
+    AOVBuffer& rb = _buffers[b];
+    
+    // Clip to the data window, buckets are top down, our rows are bottom up
+    const int dx = _data_window.x();
+    const int dy = _data_window.y();
+    const int dw = _data_window.w();
+    const int x0 = std::max(x, dx);
+    const int x1 = std::min(x + width, _data_window.r());
+    const int yy0 = std::max(0, _height - y - _data_window.t());
+    const int yy1 = std::min(height, _height - y - dy);
+    if (x0 >= x1 || yy0 >= yy1)
+        return;
+    
+    // Tiles are laid over the data window
+    const int tx0 = (x0 - dx) / TILE_SIZE;
+    const int tx1 = (x1 - 1 - dx) / TILE_SIZE;
+    const int ty0 = (_height - (y + yy1) - dy) / TILE_SIZE;
+    const int ty1 = (_height - (y + yy0) - 1 - dy) / TILE_SIZE;
+    
+    int tx, ty;
+    for (ty = ty0; ty <= ty1; ++ty)
+        for (tx = tx0; tx <= tx1; ++tx)
+            rb._tiles[ty * rb._tiles_x + tx].write_begin();
+    
+    const int count = x1 - x0;
+    int xx, yy, row, index;
+    for (yy = yy0; yy < yy1; ++yy)
+    {
+        const float* src = pixels + (width * yy + x0 - x) * spp;
+        row = _height - (yy + y + 1) - dy;
+        index = dw * row + x0 - dx;
+        
+        switch (spp)
+        {
+            case 1:
+                std::copy(src, src + count, &rb._float_data[index]);
+                break;
+            case 3:
+                for (xx = 0; xx < count; ++xx, src += 3)
+                {
+                    RenderColor& color = rb._color_data[index + xx];
+                    color[0] = src[0];
+                    color[1] = src[1];
+                    color[2] = src[2];
+                }
+                break;
+            case 4:
+                for (xx = 0; xx < count; ++xx, src += 4)
+                {
+                    RenderColor& color = rb._color_data[index + xx];
+                    color[0] = src[0];
+                    color[1] = src[1];
+                    color[2] = src[2];
+                    rb._float_data[index + xx] = src[3];
+                }
+                break;
+        }
+        
+        if (preview || !rb._preview.empty())
+            rb.mark_preview(row, x0 - dx, count, preview);
+    }
+    
+    // Coarser texels of the bucket lie in the same tiles
+    rb.update_levels(x0 - dx, _height - (y + yy1) - dy,
+                     x1 - dx, _height - (y + yy0) - dy);
+    
+    for (ty = ty0; ty <= ty1; ++ty)
+        for (tx = tx0; tx <= tx1; ++tx)
+            rb._tiles[ty * rb._tiles_x + tx].write_end();
+}
+
+int RenderBuffer::preview_tiles(const int& b) const
+{
+    if (static_cast<size_t>(b) >= _buffers.size())
+        return 0;
+    
+    const std::vector<int>& pixels = _buffers[b]._preview_pixels;
+    return static_cast<int>(pixels.size() - std::count(pixels.begin(), pixels.end(), 0));
+}
+
+// Copy the span [x, r) of row y to out, never blocks on the writer
+void RenderBuffer::read_row(const int& b,
+                            const int& y,
+                            const int& x,
+                            const int& r,
+                            const int& c,
+                            float* out) const
+{
+    const AOVBuffer& rb = _buffers[b];
+    const RenderColor* colors = rb.color_plane(0);
+    const float* floats = rb.float_plane(0);
+    const bool color = c < 3 && colors != NULL;
+    
+    // Black outside of the data window
+    const int dx = _data_window.x();
+    const int sy = y - _data_window.y();
+    const int x0 = std::max(x, dx);
+    const int x1 = std::min(r, _data_window.r());
+    if (sy < 0 || sy >= _data_window.h() || x0 >= x1)
+    {
+        std::fill(out, out + (r - x), 0.0f);
+        return;
+    }
+    std::fill(out, out + (x0 - x), 0.0f);
+    std::fill(out + (x1 - x), out + (r - x), 0.0f);
+    
+    const TileSeq* tiles = &rb._tiles[(sy / TILE_SIZE) * rb._tiles_x];
+    const int row = _data_window.w() * sy - dx;
+    
+    int xx = x0;
+    while (xx < x1)
+    {
+        // Copy up to the end of the current tile
+        const int tile_r = std::min(x1, dx + ((xx - dx) / TILE_SIZE + 1) * TILE_SIZE);
+        const TileSeq& tile = tiles[(xx - dx) / TILE_SIZE];
+        
+        unsigned int seq;
+        int i;
+        do
+        {
+            seq = tile.read_begin();
+            if (color)
+                for (i = xx; i < tile_r; ++i)
+                    out[i - x] = colors[row + i][c];
+            else
+                std::copy(floats + row + xx,
+                          floats + row + tile_r,
+                          out + (xx - x));
+        }
+        while (tile.read_retry(seq));
+        
+        xx = tile_r;
+    }
+}
+
+// Copy the span [x, r) of row y of the frame scaled down
+void RenderBuffer::read_scaled_row(const int& b,
+                                   const int& y,
+                                   const int& x,
+                                   const int& r,
+                                   const int& c,
+                                   const float& scale_x,
+                                   const float& scale_y,
+                                   float* out) const
+{
+    const AOVBuffer& rb = _buffers[b];
+    const bool color = c < 3 && rb.color_plane(0) != NULL;
+    std::fill(out, out + (r - x), 0.0f);
+    
+    // Coarsest level whose texels are no bigger than the output pixels
+    int level = 0;
+    const float scale = std::max(scale_x, scale_y);
+    while (level < static_cast<int>(rb._levels.size()) && (2 << level) * scale <= 1.0f)
+        ++level;
+    
+    // Nearest texel of the level under the output pixels
+    const int dx = _data_window.x();
+    const int sy = static_cast<int>(std::floor((y + 0.5f) / scale_y)) - _data_window.y();
+    const int sx0 = static_cast<int>(std::floor((x + 0.5f) / scale_x)) - dx;
+    const int sx1 = static_cast<int>(std::floor((r - 0.5f) / scale_x)) - dx;
+    if (sy < 0 || sy >= _data_window.h() || sx1 < 0 || sx0 >= _data_window.w())
+        return;
+    
+    const int lw = rb.level_width(level);
+    const int ly = std::min(sy >> level, rb.level_height(level) - 1);
+    const int lx0 = std::max(sx0, 0) >> level;
+    const int lx1 = std::min(std::min(sx1, _data_window.w() - 1) >> level, lw - 1) + 1;
+    
+    // Copy the texels needed per tile, a tile at this level is
+    // TILE_SIZE >> level texels wide and guarded like the full one
+    std::vector<float> texels(lx1 - lx0);
+    const int tile_size = TILE_SIZE >> level;
+    const TileSeq* tiles = &rb._tiles[(ly / tile_size) * rb._tiles_x];
+    const RenderColor* colors = color ? rb.color_plane(level) + ly * lw : NULL;
+    const float* floats = color ? NULL : rb.float_plane(level) + ly * lw;
+    
+    int lx = lx0;
+    while (lx < lx1)
+    {
+        const int tile_r = std::min(lx1, (lx / tile_size + 1) * tile_size);
+        const TileSeq& tile = tiles[lx / tile_size];
+        
+        unsigned int seq;
+        int i;
+        do
+        {
+            seq = tile.read_begin();
+            if (color)
+                for (i = lx; i < tile_r; ++i)
+                    texels[i - lx0] = colors[i][c];
+            else
+                std::copy(floats + lx, floats + tile_r, &texels[lx - lx0]);
+        }
+        while (tile.read_retry(seq));
+        
+        lx = tile_r;
+    }
+    
+    for (int i = x; i < r; ++i)
+    {
+        const int sx = static_cast<int>(std::floor((i + 0.5f) / scale_x)) - dx;
+        if (sx >= 0 && sx < _data_window.w())
+            out[i - x] = texels[std::min(sx >> level, lx1 - 1) - lx0];
+    }
+}
+
+void RenderBuffer::set_rendering(const bool& rendering)
+{
+    if (rendering)
+        ++_pass;
+    _rendering = rendering;
+}
+
+bool RenderBuffer::mapped() const
+{
+    std::vector<AOVBuffer>::const_iterator it;
+    for(it = _buffers.begin(); it != _buffers.end(); ++it)
+        if (it->_mapping)
+            return true;
+    return false;
+}
+
+// Raw pixel planes of buffer b, NULL if the AOV has none
+const RenderColor* RenderBuffer::get_color_data(const int& b) const
+{
+    return _buffers[b].color_plane(0);
+}
+
+const float* RenderBuffer::get_float_data(const int& b) const
+{
+    return _buffers[b].float_plane(0);
 }
 
 // Get the current buffer index
@@ -157,6 +612,31 @@ int RenderBuffer::get_aov_index(const Channel& z)
     return aov_index;
 }
 
+// Cache the buffer index of every channel
+void RenderBuffer::build_read_plan(const ChannelSet& channels)
+{
+    boost::shared_ptr<ReadPlan> plan(new ReadPlan);
+    plan->index.assign(channels.last() + 1, -1);
+    foreach(z, channels)
+        plan->index[z] = get_aov_index(z);
+    plan->channels = channels;
+    _plan.store(plan);
+}
+
+bool RenderBuffer::has_read_plan(const ChannelSet& channels) const
+{
+    boost::shared_ptr<const ReadPlan> plan = _plan.load();
+    return plan && plan->channels == channels;
+}
+
+int RenderBuffer::planned_aov_index(const Channel& z) const
+{
+    boost::shared_ptr<const ReadPlan> plan = _plan.load();
+    if (!plan || z < 0 || static_cast<size_t>(z) >= plan->index.size())
+        return -1;
+    return plan->index[z];
+}
+
 // Get the current buffer index
 int RenderBuffer::get_aov_index(const char* aov_name)
 {
@@ -206,10 +686,18 @@ bool RenderBuffer::first_aov_name(const char* aovName)
     return strcmp(_aovs.front().c_str(), aovName) == 0;
 }
 
-// Check if Aovs has been changed
+// Check if Aovs has been changed, deferred AOVs
+// may arrive in a different order than last time
 bool RenderBuffer::aovs_changed(const std::vector<std::string>& aovs)
 {
-    return (aovs != _aovs);
+    if (aovs.size() != _aovs.size() || aovs.front() != _aovs.front())
+        return true;
+    
+    std::vector<std::string>::const_iterator it;
+    for(it = aovs.begin(); it != aovs.end(); ++it)
+        if (std::find(_aovs.begin(), _aovs.end(), *it) == _aovs.end())
+            return true;
+    return false;
 }
 
 // Check if Resolution has been changed
@@ -225,37 +713,84 @@ bool RenderBuffer::camera_changed(const float& fov,
     return (_fov != fov || _matrix != matrix);
 }
 
+bool RenderBuffer::data_window_changed(const Box& window) const
+{
+    return (window.x() != _data_window.x() || window.y() != _data_window.y() ||
+            window.r() != _data_window.r() || window.t() != _data_window.t());
+}
+
+// Copy the pixels of src that fall into the window of dst,
+// both planes cover their own window of the image
+template <typename T>
+static void keep_pixels(const std::vector<T>& src, const Box& src_window,
+                        std::vector<T>& dst, const Box& dst_window)
+{
+    const int x0 = std::max(src_window.x(), dst_window.x());
+    const int x1 = std::min(src_window.r(), dst_window.r());
+    const int y0 = std::max(src_window.y(), dst_window.y());
+    const int y1 = std::min(src_window.t(), dst_window.t());
+    for (int y = y0; y < y1; ++y)
+    {
+        const T* in = &src[(y - src_window.y()) * src_window.w() + x0 - src_window.x()];
+        std::copy(in, in + (x1 - x0),
+                  &dst[(y - dst_window.y()) * dst_window.w() + x0 - dst_window.x()]);
+    }
+}
+
 // Resize the containers to match the resolution
 void RenderBuffer::set_resolution(const unsigned int& w,
-                                  const unsigned int& h)
+                                  const unsigned int& h,
+                                  const Box& window,
+                                  const bool& keep)
 {
+    // Pixels stay anchored at the top left like the driver's
+    // buckets, so the old window moves with the height
+    const int shift = static_cast<int>(h) - _height;
+    const Box old_window(_data_window.x(), _data_window.y() + shift,
+                         _data_window.r(), _data_window.t() + shift);
+    
     _width = w;
     _height = h;
+    _data_window = window;
     
-    const int size = _width * _height;
+    const int size = _data_window.w() * _data_window.h();
     
     std::vector<AOVBuffer>::iterator it;
     for(it = _buffers.begin(); it != _buffers.end(); ++it)
     {
         if (!it->_color_data.empty())
         {
-            RenderColor color;
-            std::fill(it->_color_data.begin(), it->_color_data.end(), color);
-            it->_color_data.resize(size);
+            std::vector<RenderColor> color_data(size);
+            if (keep)
+                keep_pixels(it->_color_data, old_window, color_data, _data_window);
+            it->_color_data.swap(color_data);
         }
         if (!it->_float_data.empty())
         {
-            std::fill(it->_float_data.begin(), it->_float_data.end(), 0.0f);
-            it->_float_data.resize(size);
+            std::vector<float> float_data(size, 0.0f);
+            if (keep)
+                keep_pixels(it->_float_data, old_window, float_data, _data_window);
+            it->_float_data.swap(float_data);
         }
+        it->set_tiles(_data_window.w(), _data_window.h());
+        if (keep)
+            it->build_levels();
     }
 }
 
+void RenderBuffer::set_resolution(const unsigned int& w,
+                                  const unsigned int& h,
+                                  const bool& keep)
+{
+    set_resolution(w, h, Box(0, 0, w, h), keep);
+}
+
 // Clear buffers and aovs
 void RenderBuffer::clear_all()
 {
     _buffers = std::vector<AOVBuffer>();
     _aovs = std::vector<std::string>();
+    _plan.clear();
 }
 
 // Check if the given buffer/aov name name is exist
@@ -269,23 +804,26 @@ void RenderBuffer::resize(const size_t& s)
 {
     _aovs.resize(s);
     _buffers.resize(s);
+    _plan.clear();
 }
 
 // Set status parameters
 void RenderBuffer::set_progress(const long long& progress)
 {
-    _progress = progress > 100 ? 100 : progress;
+    _progress.store(progress > 100 ? 100 : progress);
 }
 
-void RenderBuffer::set_memory(const long long& ram)
+void RenderBuffer::set_memory(const long long& ram,
+                              const long long& peak_ram)
 {
-    _ram = static_cast<int>(ram / 1048576);
-    _pram = _ram > _pram ? _ram : _pram;
+    const long long mb = static_cast<int>(ram / 1048576);
+    _ram.store(mb);
+    _pram.store(std::max(std::max(mb, peak_ram / 1048576), _pram.load()));
 }
 void RenderBuffer::set_time(const int& time,
                             const int& dtime)
 {
-    _time = dtime > time ? time : time - dtime;
+    _time.store(dtime > time ? time : time - dtime);
 }
 
 // Set Version
@@ -362,7 +900,7 @@ RenderBuffer* FrameBuffer::add_renderbuffer(DataHeader* dh)
             rb = _renderbuffers.back();
 
         _frame  = dh->frame();
-        _session = dh->session();
+        add_session(dh->session());
         _frames.push_back(dh->frame());
         _renderbuffers.push_back(rb);
         return &_renderbuffers.back();
@@ -371,12 +909,38 @@ RenderBuffer* FrameBuffer::add_renderbuffer(DataHeader* dh)
 // Udpate RenderBuffer
 void FrameBuffer::update_renderbuffer(DataHeader* dh)
 {
-    _session = dh->session();
+    add_session(dh->session());
     _output_name = (boost::format("%s_%d_%s")%dh->output_name()
                                              %dh->frame()%get_date()).str();
     _frame  = dh->frame();
 }
 
+void FrameBuffer::set_session(long long index)
+{
+    _session = index;
+    _sessions = std::vector<long long>(1, index);
+    
+    // Rendered to again, the cached copy no longer matches
+    if (index != 0)
+        _cache_file.clear();
+}
+
+void FrameBuffer::add_session(const long long& index)
+{
+    if (index != 0)
+        _cache_file.clear();
+    
+    if (std::find(_sessions.begin(), _sessions.end(), index) == _sessions.end())
+        _sessions.push_back(index);
+    _session = index;
+}
+
+bool FrameBuffer::has_session(const long long& index)
+{
+    return index == _session ||
+           std::find(_sessions.begin(), _sessions.end(), index) != _sessions.end();
+}
+
 // Clear All Data
 void FrameBuffer::clear_all()
 {
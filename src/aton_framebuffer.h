@@ -8,7 +8,10 @@ All rights reserved. See COPYING.txt for more details.
 #define FenderBuffer_h
 
 #include <DDImage/Iop.h>
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
 #include "aton_client.h"
+#include "aton_flipbook.h"
 
 using namespace DD::Image;
 
@@ -38,10 +41,95 @@ public:
     float _val[3];
 };
 
+// Tile size the AOV buffers are split into for concurrent access
+const int TILE_SIZE = 64;
+
+// Sequence counter guarding one tile of an AOV buffer
+// The writer keeps it odd while the tile is modified, readers
+// never block and just retry their copy if the counter has moved
+class TileSeq
+{
+public:
+    TileSeq(): _seq(0) {}
+    
+    // Copies always start even, the source may be mid write
+    TileSeq(const TileSeq& other): _seq(0) {}
+    TileSeq& operator=(const TileSeq& other) { _seq.store(0); return *this; }
+    
+    // Reader side
+    unsigned int read_begin() const;
+    bool read_retry(const unsigned int& seq) const;
+    
+    // Writer side, only one writer per tile at a time
+    void write_begin();
+    void write_end();
+    
+private:
+    boost::atomic<unsigned int> _seq;
+};
+
+// Buffer index per channel, and the channels it was built for
+struct ReadPlan
+{
+    std::vector<int> index;
+    ChannelSet channels;
+};
+
+// Current ReadPlan of a RenderBuffer. A new plan is swapped in whole,
+// so it can be built under the shared lock while the engine still
+// reads the one before.
+class ReadPlanSlot
+{
+public:
+    ReadPlanSlot() {}
+    
+    // Copies start without a plan, the source may be swapping its own
+    ReadPlanSlot(const ReadPlanSlot& other) {}
+    ReadPlanSlot& operator=(const ReadPlanSlot& other) { clear(); return *this; }
+    
+    boost::shared_ptr<const ReadPlan> load() const;
+    void store(const boost::shared_ptr<const ReadPlan>& plan);
+    void clear() { store(boost::shared_ptr<const ReadPlan>()); }
+    
+private:
+    boost::shared_ptr<const ReadPlan> _plan;
+};
+
+// Status of a RenderBuffer the writer sets under the shared lock
+// while the node reads it, copies take the value it has
+template <typename T>
+class StatusValue
+{
+public:
+    StatusValue(const T& value = T()): _value(value) {}
+    StatusValue(const StatusValue& other): _value(other.load()) {}
+    StatusValue& operator=(const StatusValue& other) { store(other.load()); return *this; }
+    
+    T load() const { return _value.load(); }
+    void store(const T& value) { _value.store(value); }
+    
+private:
+    boost::atomic<T> _value;
+};
+
+// Most halvings of the pyramid kept per AOV for zoomed out and proxy
+// reads. A level tile is TILE_SIZE >> level wide, so every level shares
+// the tile grid, and its counters, of the full resolution.
+const int MIP_LEVELS = 4;
+
+// One level of the pyramid, half the size of the one before
+struct AOVLevel
+{
+    int width, height;
+    std::vector<RenderColor> color_data;
+    std::vector<float> float_data;
+};
+
 // AOV Buffer class
 class AOVBuffer
 {
     friend class RenderBuffer;
+    friend class SessionCache;
     
 public:
     AOVBuffer(const unsigned int& width = 0,
@@ -49,9 +137,50 @@ public:
               const int& spp = 0);
     
 private:
+    // Resize the tile grid and the pyramid to match the resolution
+    void set_tiles(const unsigned int& width,
+                   const unsigned int& height);
+    
+    // Box filter the pixels [x0, x1) x [y0, y1) down the pyramid,
+    // the tiles holding them have to be held by the caller
+    void update_levels(int x0, int y0, int x1, int y1);
+    void build_levels() { update_levels(0, 0, _width, _height); }
+    
+    // Planes of level 0, the full resolution, up to _levels.size()
+    int level_width(const int& level) const;
+    int level_height(const int& level) const;
+    const RenderColor* color_plane(const int& level) const;
+    const float* float_plane(const int& level) const;
+    
+    // Flag count pixels of the row from x as preview or exact,
+    // the tiles holding them have to be held by the caller
+    void mark_preview(const int& row,
+                      const int& x,
+                      const int& count,
+                      const bool& preview);
+    
     // Data
     std::vector<RenderColor> _color_data;
     std::vector<float> _float_data;
+    int _width, _height;
+    
+    // Levels 1 and up of the pyramid
+    std::vector<AOVLevel> _levels;
+    
+    // Tile sequence counters, row major
+    std::vector<TileSeq> _tiles;
+    int _tiles_x;
+    
+    // Pixels only holding a preview so far, and their count per
+    // tile. The mask is only allocated once a preview arrives.
+    std::vector<unsigned char> _preview;
+    std::vector<int> _preview_pixels;
+    
+    // Level 0 served straight from the session cache file instead,
+    // copies of the buffer share the mapping until the last one goes
+    boost::shared_ptr<const void> _mapping;
+    const RenderColor* _mapped_color;
+    const float* _mapped_float;
 };
 
 
@@ -59,6 +188,7 @@ private:
 class RenderBuffer
 {
     friend class FrameBuffer;
+    friend class SessionCache;
     
 public:
     RenderBuffer(const double& currentFrame = 0,
@@ -84,12 +214,60 @@ public:
                              const int& y,
                              const int& c) const;
     
+    // Write a whole bucket coming from the driver, guarded per tile
+    // A preview is shown until the exact pixels overwrite it
+    void write_bucket(const int& b,
+                      const int& x,
+                      const int& y,
+                      const int& width,
+                      const int& height,
+                      const int& spp,
+                      const float* pixels,
+                      const bool& preview = false);
+    
+    // Tiles of buffer b with pixels still only holding a preview
+    int preview_tiles(const int& b = 0) const;
+    
+    // Copy the span [x, r) of row y to out, never blocks on the writer
+    // Pixels outside of the data window are black
+    void read_row(const int& b,
+                  const int& y,
+                  const int& x,
+                  const int& r,
+                  const int& c,
+                  float* out) const;
+    
+    // Copy the span [x, r) of row y of the frame scaled by scale_x and
+    // scale_y, from the coarsest pyramid level still as fine as that
+    void read_scaled_row(const int& b,
+                         const int& y,
+                         const int& x,
+                         const int& r,
+                         const int& c,
+                         const float& scale_x,
+                         const float& scale_y,
+                         float* out) const;
+    
+    // Raw pixel planes of buffer b, covering the data window,
+    // NULL if the AOV has none
+    const RenderColor* get_color_data(const int& b) const;
+    const float* get_float_data(const int& b) const;
+    
     // Get AOVs
     std::vector<std::string>& get_aovs() { return _aovs; }
+    const std::vector<std::string>& get_aovs() const { return _aovs; }
     
     // Get the current buffer index
     int get_aov_index(const Channel& z);
     
+    // Work out the buffer index of every channel ahead of the engine,
+    // the shared lock is enough as the plan is swapped in whole
+    void build_read_plan(const ChannelSet& channels);
+    bool has_read_plan(const ChannelSet& channels) const;
+    
+    // Planned buffer index of the channel, -1 if it wasn't planned
+    int planned_aov_index(const Channel& z) const;
+    
     // Get the current buffer index
     int get_aov_index(const char* aovName);
     
@@ -114,9 +292,20 @@ public:
     // Check if Camera fov has been changed
     bool camera_changed(const float& fov, const Matrix4& matrix);
     
-    // Resize the containers to match the resolution
+    // Check if the Data Window has been changed
+    bool data_window_changed(const Box& window) const;
+    
+    // Resize the containers to match the resolution and data window,
+    // keep the pixels that still fit when compositing a region
     void set_resolution(const unsigned int& w,
-                        const unsigned int& h);
+                        const unsigned int& h,
+                        const Box& window,
+                        const bool& keep = false);
+    
+    // Same with the data window covering the whole frame
+    void set_resolution(const unsigned int& w,
+                        const unsigned int& h,
+                        const bool& keep = false);
     
     // Clear buffers and aovs
     void clear_all();
@@ -130,6 +319,10 @@ public:
     // Get height of the buffer
     const int& get_height() const { return _height; }
     
+    // Part of the frame holding pixels, the AOV planes and tiles
+    // only cover it. Rows are bottom up like the buffer's.
+    const Box& get_data_window() const { return _data_window; }
+    
     // Get pixel aspect of the buffer
     const float& get_pixel_aspect() const { return _pix_aspect; }
     
@@ -143,14 +336,15 @@ public:
     void resize(const size_t& s);
     
     // Status parameters
-    const long long& get_progress() { return _progress; }
+    long long get_progress() const { return _progress.load(); }
     void set_progress(const long long& progress = 0);
     
-    const long long& get_memory() { return _ram; }
-    const long long& get_peak_memory() { return _pram; }
-    void set_memory(const long long& ram = 0);
+    long long get_memory() const { return _ram.load(); }
+    long long get_peak_memory() const { return _pram.load(); }
+    void set_memory(const long long& ram = 0,
+                    const long long& peak_ram = 0);
     
-    const int& get_time() { return _time; }
+    int get_time() const { return _time.load(); }
     void set_time(const int& time = 0,
                   const int& dtime = 0);
     
@@ -169,11 +363,25 @@ public:
     void set_frame(const double& frame) { _frame = frame; }
     
     // To keep False while writing the buffer
-    void set_ready(const bool& ready) { _ready = ready; }
-    const bool& ready() const { return _ready; }
+    void set_ready(const bool& ready) { _ready.store(ready); }
+    bool ready() const { return _ready.load(); }
+    
+    // Pixels per side the latest beauty bucket was sent downsampled by
+    void set_downsampling(const int& scale) { _downsampling.store(scale); }
+    int get_downsampling() const { return _downsampling.load(); }
+    
+    // A connected render is still writing this frame, every
+    // render opening it starts a new pass over its pixels
+    void set_rendering(const bool& rendering);
+    const bool& rendering() const { return _rendering; }
+    const int& get_pass() const { return _pass; }
+    
+    // Buckets the driver rendered since the image was opened
+    void set_buckets(const int& buckets) { _buckets.store(buckets); }
+    int get_buckets() const { return _buckets.load(); }
     
     // Camera
-    const float& get_camera_fov() { return _fov; }
+    const float& get_camera_fov() const { return _fov; }
     const Matrix4& get_camera_matrix() { return _matrix; }
     void set_camera(const float& fov, const Matrix4& matrix);
     
@@ -181,16 +389,32 @@ public:
     const char* get_name() { return _name.c_str(); }
     void set_name(std::string name) { _name = name; }
     
+    // Pixels are still in the session cache, see SessionCache::page_in
+    bool paged_out() const { return !_cache_spp.empty(); }
+    
+    // Planes are read from a mapped file, see SessionCache::page_out
+    bool mapped() const;
+    
+    // Display ready copy of the RGBA for playback
+    const FlipbookFrame& get_flipbook() const { return _flipbook; }
+    void set_flipbook(FlipbookFrame& flipbook) { _flipbook.swap(flipbook); }
+    void clear_flipbook() { _flipbook.clear(); }
+    
 private:
     double _frame;
-    long long _progress;
-    int _time;
-    long long _ram;
-    long long _pram;
+    StatusValue<long long> _progress;
+    StatusValue<int> _time;
+    StatusValue<long long> _ram;
+    StatusValue<long long> _pram;
     int _width;
     int _height;
+    Box _data_window;
     float _pix_aspect;
-    bool _ready;
+    StatusValue<bool> _ready;
+    bool _rendering;
+    int _pass;
+    StatusValue<int> _downsampling;
+    StatusValue<int> _buckets;
     float _fov;
     Matrix4 _matrix;
     int _version_int;
@@ -200,11 +424,22 @@ private:
     std::string _samples_str;
     std::vector<AOVBuffer> _buffers;
     std::vector<std::string> _aovs;
+    
+    FlipbookFrame _flipbook;
+    
+    ReadPlanSlot _plan;
+    
+    // Where the pixels of each AOV sit in the cache file while paged out
+    std::string _cache_file;
+    std::vector<int> _cache_spp;
+    std::vector<long long> _cache_offsets;
 };
 
 // FrameBuffer Class
 class FrameBuffer
 {
+    friend class SessionCache;
+    
 public:
     FrameBuffer() {};
     
@@ -230,8 +465,12 @@ public:
     double get_frame() { return _frame; }
     void set_frame(double frame) { _frame = frame; }
     
+    // Latest session, a multi-frame FrameBuffer may be fed
+    // by several render processes at once
     long long& get_session() { return _session; }
-    void set_session(long long index) { _session = index; }
+    void set_session(long long index);
+    void add_session(const long long& index);
+    bool has_session(const long long& index);
     
     std::string get_output_name() { return _output_name; }
     void set_output_name(std::string name) { _output_name = name; }
@@ -243,9 +482,11 @@ public:
 private:
     double _frame;
     long long _session;
+    std::vector<long long> _sessions;
     std::string _output_name;
     std::vector<double> _frames;
     std::vector<RenderBuffer> _renderbuffers;
+    std::string _cache_file;
 };
 
 #endif /* FenderBuffer_h */
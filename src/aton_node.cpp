@@ -6,6 +6,9 @@ All rights reserved. See COPYING.txt for more details.
 
 #include "aton_node.h"
 #include "aton_fb_writer.h"
+#ifdef ATON_OPENEXR
+#include "aton_fb_capture.h"
+#endif
 #include "aton_fb_updater.h"
 
 #include <boost/regex.hpp>
@@ -17,6 +20,7 @@ All rights reserved. See COPYING.txt for more details.
 void Aton::attach()
 {
     m_legit = true;
+    start_updater();
 
     // Default status bar
     set_status();
@@ -25,6 +29,7 @@ void Aton::attach()
     knob("formats_knob")->hide();
     knob("capturing_knob")->hide();
     knob("cam_fov_knob")->hide();
+    knob("cache_id_knob")->hide();
     
     // Reset Region
     knob("region_knob")->set_value(0);
@@ -58,6 +63,19 @@ void Aton::attach()
 
     if (!m_format_exists)
         m_fmt.add(m_node_name.c_str());
+    
+    // New nodes get their cache id here, a script
+    // being loaded sets the stored one over it
+    if (m_node->m_cache_id.empty())
+    {
+        std::string cache_id = unique_path("%%%%%%%%%%%%%%%%").string();
+        knob("cache_id_knob")->set_text(cache_id.c_str());
+        m_node->m_cache_id = cache_id;
+    }
+    
+    // Snapshots are read back on the first validate,
+    // once the knobs hold the values from the script
+    m_node->m_cache_restored = false;
 }
 
 void Aton::detach()
@@ -66,8 +84,25 @@ void Aton::detach()
     // undo stack) we should close the port and reopen if attach() gets called.
     m_legit = false;
     disconnect();
-    WriteGuard lock(m_node->m_mutex);
-    m_node->m_framebuffers = std::vector<FrameBuffer>();
+    stop_updater();
+    
+    std::vector<FrameBuffer> fbs;
+    {
+        WriteGuard lock(m_node->m_mutex);
+        fbs.swap(m_node->m_framebuffers);
+    }
+    
+    // Captures find their output gone and stop
+    wait_captures();
+    
+    // Snapshots are cached as they are taken, this adds the
+    // live sessions for the next time the script is opened
+    if (m_node->m_cache_restored)
+        SessionCache::save(get_cache_path(), fbs);
+    
+    // Paged out frames go once nothing maps them any more
+    fbs = std::vector<FrameBuffer>();
+    SessionCache::drop_pages(get_cache_path());
 }
 
 void Aton::append(Hash& hash)
@@ -75,93 +110,259 @@ void Aton::append(Hash& hash)
     hash.append(m_node->m_hash_count);
     hash.append(uiContext().frame());
     hash.append(outputContext().frame());
+    
+    // The viewed FrameBuffer is resolved here, the
+    // updater thread mustn't read the output knob
+    notify_frame(current_fb_index(false), outputContext().frame());
 }
 
 void Aton::_validate(bool for_real)
 {
-    if (!m_node->m_server.connected() && !m_inError && m_legit)
+    if (!IngestService::instance().connected(m_node->m_listen_port) && !m_inError && m_legit)
         change_port(m_port);
     
+    // Batches of the node being looked at are applied first
+    IngestService::instance().set_focus(m_node);
+    
     // Handle any connection error
     if (m_inError)
         error(m_connection_error.c_str());
    
+    // Bring back the snapshots of the last session
+    if (!m_node->m_cache_restored && m_legit)
+        restore_cache();
+    
     // Update Outputs
     set_outputs();
     
-    ReadGuard lock(m_node->m_mutex);
-    RenderBuffer* rb = current_renderbuffer();
-
-    if (rb != NULL && !rb->empty() && rb->ready())
+    bool viewed = false;
+    double frame = 0;
+    const int output = current_fb_index(false);
+    Box bbox = m_node->info().format();
     {
-        // Update Format
-        set_format(rb->get_width(),
-                   rb->get_height(),
-                   rb->get_pixel_aspect());
+        ReadGuard lock(m_node->m_mutex);
+        RenderBuffer* rb = current_renderbuffer();
         
-        // Update Channels
-        set_channels(rb->get_aovs(),
-                     rb->ready());
-        
-        // Udpate Status Bar
-        set_status(rb->get_progress(),
-                   rb->get_memory(),
-                   rb->get_peak_memory(),
-                   rb->get_time(),
-                   rb->get_frame(),
-                   rb->get_name(),
-                   rb->get_version_str(),
-                   rb->get_samples());
-        
-        // Update Camera
-        set_camera(rb->get_camera_fov(),
-                   rb->get_camera_matrix());
-        
-        // Update UI Frame
-        set_current_frame(rb->get_frame());
+        if (rb != NULL && !rb->empty() && rb->ready())
+        {
+            // Update Format
+            set_format(rb->get_width(),
+                       rb->get_height(),
+                       rb->get_pixel_aspect());
+            
+            // Update Channels
+            set_channels(rb->get_aovs(),
+                         rb->ready());
+            
+            // Udpate Status Bar
+            set_status(rb->get_progress(),
+                       rb->get_memory(),
+                       rb->get_peak_memory(),
+                       rb->get_time(),
+                       rb->get_frame(),
+                       rb->get_name(),
+                       rb->get_version_str(),
+                       rb->get_samples(),
+                       rb->rendering(),
+                       rb->preview_tiles(),
+                       rb->get_downsampling(),
+                       rb->get_buckets());
+            
+            // Update Camera
+            set_camera(rb->get_camera_fov(),
+                       rb->get_camera_matrix());
+            
+            // Update UI Frame
+            set_current_frame(rb->get_frame());
+            
+            // Only the data window holds pixels, with a black
+            // border around it so the edge pixels don't streak
+            const Box& window = rb->get_data_window();
+            if (window.w() < rb->get_width() || window.h() < rb->get_height())
+            {
+                const float scale_x = outputContext().scale_x();
+                const float scale_y = outputContext().scale_y();
+                bbox.set(static_cast<int>(std::floor(window.x() * scale_x)) - 1,
+                         static_cast<int>(std::floor(window.y() * scale_y)) - 1,
+                         static_cast<int>(std::ceil(window.r() * scale_x)) + 1,
+                         static_cast<int>(std::ceil(window.t() * scale_y)) + 1);
+            }
+            
+            viewed = true;
+            frame = rb->get_frame();
+        }
     }
+    
+    // Unless the prefetcher got there first, map the pixels of a
+    // restored snapshot in and plan the channels for the engine
+    if (viewed)
+        prepare_frame(output, frame);
 
     // Setup format etc
     info_.format(*m_node->m_fmtp.format());
     info_.full_size_format(*m_node->m_fmtp.fullSizeFormat());
     info_.channels(m_node->m_channels);
-    info_.set(m_node->info().format());
+    info_.set(bbox);
 }
 
-void Aton::engine(int y, int x, int r, ChannelMask channels, Row& out)
+void Aton::_request(int x, int y, int r, int t, ChannelMask channels, int /*count*/)
+{
+    // Let the renders send what the viewer is looking at first,
+    // the driver's buckets are top down and at full resolution
+    ViewRegion region;
+    
+    // Without AOVs only the beauty is of any use
+    AovSubscription subscription(m_enable_aovs);
+    
+    // Older snapshots don't keep the render going
+    bool live = false;
+    {
+        ReadGuard lock(m_node->m_mutex);
+        RenderBuffer* rb = current_renderbuffer();
+        live = rb != NULL && rb->rendering();
+        if (rb != NULL && m_enable_aovs && !rb->empty())
+            foreach(z, channels)
+                subscription.add_viewed(rb->get_aov_name(rb->get_aov_index(z)));
+        
+        if (rb != NULL && rb->get_height() > 0)
+        {
+            const float scale_x = outputContext().scale_x();
+            const float scale_y = outputContext().scale_y();
+            const int& h = rb->get_height();
+            region = ViewRegion(static_cast<int>(std::floor(x / scale_x)),
+                                h - static_cast<int>(std::ceil(t / scale_y)),
+                                static_cast<int>(std::ceil(r / scale_x)) - 1,
+                                h - static_cast<int>(std::floor(y / scale_y)) - 1,
+                                scale_x);
+        }
+    }
+    
+    IngestService& service = IngestService::instance();
+    service.set_subscription(m_node->m_listen_port, subscription);
+    if (!region.empty())
+        service.set_region(m_node->m_listen_port, region);
+    if (live)
+        service.keep_alive(m_node->m_listen_port);
+}
+
+// RenderBuffer the engine may read from, the caller holds m_mutex
+RenderBuffer* Aton::readable_renderbuffer()
 {
-    ReadGuard lock(m_node->m_mutex);
     RenderBuffer* rb = current_renderbuffer();
+    if (rb != NULL && rb->ready() && !rb->paged_out())
+        return rb;
+    return NULL;
+}
+
+// Copy the span [x, r) of row y of channel z, the caller holds m_mutex
+void Aton::read_pixels(RenderBuffer* rb,
+                       const int& y,
+                       const int& x,
+                       const int& r,
+                       const Channel& z,
+                       float* out)
+{
+    // Zoomed out viewers and proxy mode read from the pyramid
+    const float scale_x = outputContext().scale_x();
+    const float scale_y = outputContext().scale_y();
+    const bool scaled = scale_x != 1.0f || scale_y != 1.0f;
     
-    int w = 0, h = 0;
-    if (rb != NULL)
+    if (rb == NULL || y < 0 || (!scaled && y >= rb->get_height()))
     {
-        w = rb->get_width();
-        h = rb->get_height();
+        std::fill(out, out + (r - x), 0.0f);
+        return;
     }
     
-    foreach(z, channels)
+    int b = 0;
+    if (m_enable_aovs)
     {
-        int b = 0;
-        int xx = x;
-        const int c = colourIndex(z);
-        float* cOut = out.writable(z) + x;
-        const float* END = cOut + (r - x);
-        
-        if (m_enable_aovs && rb != NULL && rb->ready())
+        b = rb->planned_aov_index(z);
+        if (b < 0)
             b = rb->get_aov_index(z);
-        
-        while (cOut < END)
+    }
+    
+    if (scaled)
+    {
+        rb->read_scaled_row(b, y, x, r, colourIndex(z), scale_x, scale_y, out);
+        return;
+    }
+    
+    // The bbox has a border around the image, black outside of it
+    const int sx = std::max(x, 0);
+    const int sr = std::min(r, rb->get_width());
+    if (sx >= sr)
+    {
+        std::fill(out, out + (r - x), 0.0f);
+        return;
+    }
+    std::fill(out, out + (sx - x), 0.0f);
+    std::fill(out + (sr - x), out + (r - x), 0.0f);
+    float* span = out + (sx - x);
+    
+    // Finished frames play RGBA from their half float copy,
+    // which covers the data window like the buffers do
+    const Box& window = rb->get_data_window();
+    const int x0 = std::max(sx, window.x());
+    const int x1 = std::min(sr, window.r());
+    const int fy = y - window.y();
+    if (m_flipbook && z >= Chan_Red && z <= Chan_Alpha &&
+        x0 < x1 && fy >= 0 && fy < window.h() &&
+        rb->get_flipbook().matches(window.w(), window.h()))
+    {
+        std::fill(span, span + (x0 - sx), 0.0f);
+        rb->get_flipbook().read_row(fy, x0 - window.x(), x1 - window.x(),
+                                    colourIndex(z), span + (x0 - sx));
+        std::fill(span + (x1 - sx), span + (sr - sx), 0.0f);
+        return;
+    }
+    
+    rb->read_row(b, y, sx, sr, colourIndex(z), span);
+}
+
+#ifdef ATON_PLANAR
+void Aton::renderStripe(ImagePlane& plane)
+{
+    plane.makeWritable();
+    
+    const Box& box = plane.bounds();
+    const int stride = plane.colStride();
+    std::vector<float> row(stride == 1 ? 0 : box.w());
+    
+    // Shared with the ingest thread, taken once for the whole
+    // stripe, pixels are still read per tile
+    ReadGuard lock(m_node->m_mutex);
+    RenderBuffer* rb = readable_renderbuffer();
+    
+    foreach(z, plane.channels())
+    {
+        const int chan = plane.chanNo(z);
+        for (int y = box.y(); y < box.t(); ++y)
         {
-            if (rb == NULL || !rb->ready() || x >= w || y >= h || r > w)
-                *cOut = 0.0f;
-            else
-                *cOut = rb->get_aov_pix(b, xx, y, c);
-            ++cOut;
-            ++xx;
+            float* out = &plane.writableAt(box.x(), y, chan);
+            if (stride == 1)
+            {
+                read_pixels(rb, y, box.x(), box.r(), z, out);
+                continue;
+            }
+            
+            read_pixels(rb, y, box.x(), box.r(), z, &row[0]);
+            for (size_t i = 0; i < row.size(); ++i)
+                out[i * stride] = row[i];
         }
     }
 }
+#else
+void Aton::engine(int y, int x, int r, ChannelMask channels, Row& out)
+{
+    // Shared with the ingest thread, pixels are read per tile
+    // without waiting for the bucket being written
+    ReadGuard lock(m_node->m_mutex);
+    RenderBuffer* rb = readable_renderbuffer();
+    
+    foreach(z, channels)
+        read_pixels(rb, y, x, r, z, out.writable(z) + x);
+}
+#endif
 
 void Aton::knobs(Knob_Callback f)
 {
@@ -170,6 +371,12 @@ void Aton::knobs(Knob_Callback f)
     Int_knob(f, &m_port, "port_knob", "Port");
     Knob* reset_knob = Button(f, "reset_port_knob", "Reset");
     
+    // Render control knobs
+    Divider(f, "Render Control");
+    Knob* pause_knob = Bool_knob(f, &m_pause, "pause_knob", "Pause");
+    Knob* abort_knob = Button(f, "abort_knob", "Abort");
+    Knob* auto_pause_knob = Float_knob(f, &m_auto_pause, "auto_pause_knob", "Pause When Unseen");
+    
     // Camera knobs
     Divider(f, "Camera");
     Knob* live_cam_knob = Bool_knob(f, &m_live_camera, "live_camera_knob", "Create Live Camera");
@@ -178,6 +385,7 @@ void Aton::knobs(Knob_Callback f)
     Divider(f, "Snapshots");
     Bool_knob(f, &m_enable_aovs, "enable_aovs_knob", "Enable AOVs");
     Bool_knob(f, &m_multiframes, "multi_frame_knob", "Multiple Frames Mode");
+    Bool_knob(f, &m_flipbook, "flipbook_knob", "Flipbook");
     m_outputKnob = Table_knob(f, "output_knob", "Output");
     if (f.makeKnobs())
     {
@@ -194,6 +402,7 @@ void Aton::knobs(Knob_Callback f)
     Divider(f, "Render Region");
     Knob* region_knob = BBox_knob(f, m_region, "region_knob", "Area");
     Button(f, "copy_clipboard_knob", "Copy");
+    Knob* region_update_knob = Bool_knob(f, &m_region_update, "region_update_knob", "Update Region Only");
     
     // Write knobs
     Divider(f, "Write to Disk");
@@ -203,6 +412,9 @@ void Aton::knobs(Knob_Callback f)
     Button(f, "render_knob", "Render");
     Button(f, "import_latest_knob", "Read Latest");
     Button(f, "import_all_knob", "Read All");
+    Newline(f);
+    Knob* checkpoint_knob = Bool_knob(f, &m_checkpoint, "checkpoint_knob", "Checkpoint");
+    Button(f, "recover_knob", "Recover");
     
     // Status Bar
     BeginToolbar(f, "status_bar");
@@ -213,6 +425,7 @@ void Aton::knobs(Knob_Callback f)
     Format_knob(f, &m_fmtp, "formats_knob", "format");
     Bool_knob(f, &m_capturing, "capturing_knob");
     Float_knob(f, &m_cam_fov, "cam_fov_knob", " cFov");
+    String_knob(f, &m_cache_id, "cache_id_knob");
     
     for (int i=0; i<16; ++i)
     {
@@ -222,6 +435,9 @@ void Aton::knobs(Knob_Callback f)
     
     // Setting Flags
     reset_knob->set_flag(Knob::NO_RERENDER, true);
+    pause_knob->set_flag(Knob::NO_RERENDER, true);
+    abort_knob->set_flag(Knob::NO_RERENDER, true);
+    auto_pause_knob->set_flag(Knob::NO_RERENDER, true);
     path_knob->set_flag(Knob::NO_RERENDER, true);
     live_cam_knob->set_flag(Knob::NO_RERENDER, true);
     move_up->set_flag(Knob::NO_RERENDER, true);
@@ -229,7 +445,9 @@ void Aton::knobs(Knob_Callback f)
     move_down->set_flag(Knob::NO_RERENDER, true);
     remove_selectd->set_flag(Knob::NO_RERENDER, true);
     write_multi_frame_knob->set_flag(Knob::NO_RERENDER, true);
+    checkpoint_knob->set_flag(Knob::NO_RERENDER, true);
     region_knob->set_flag(Knob::NO_RERENDER, true);
+    region_update_knob->set_flag(Knob::NO_RERENDER, true);
     statusKnob->set_flag(Knob::NO_RERENDER, true);
     statusKnob->set_flag(Knob::DISABLED, true);
     statusKnob->set_flag(Knob::READ_ONLY, true);
@@ -249,6 +467,21 @@ int Aton::knob_changed(Knob* _knob)
         change_port(m_port);
         return 1;
     }
+    if (_knob->is("pause_knob"))
+    {
+        IngestService::instance().set_control(m_listen_port, m_pause ? RENDER_PAUSE : RENDER_RUN);
+        return 1;
+    }
+    if (_knob->is("abort_knob"))
+    {
+        IngestService::instance().set_control(m_listen_port, RENDER_ABORT);
+        return 1;
+    }
+    if (_knob->is("auto_pause_knob"))
+    {
+        IngestService::instance().set_auto_pause(m_listen_port, m_auto_pause);
+        return 1;
+    }
     if (_knob->is("output_knob"))
     {
         select_output_cmd(_knob->tableKnob());
@@ -279,6 +512,11 @@ int Aton::knob_changed(Knob* _knob)
         multiframe_cmd();
         return 1;
     }
+    if (_knob->is("flipbook_knob"))
+    {
+        request_flipbook();
+        return 1;
+    }
     if (_knob->is("live_camera_knob"))
     {
         live_camera_toogle();
@@ -304,6 +542,11 @@ int Aton::knob_changed(Knob* _knob)
         import_cmd(true);
         return 1;
     }
+    if (_knob->is("recover_knob"))
+    {
+        recover_cmd();
+        return 1;
+    }
     return 0;
 }
 
@@ -318,7 +561,7 @@ void Aton::change_port(int port)
 
     try
     {
-        m_server.connect(port, true);
+        m_listen_port = IngestService::instance().subscribe(port, true, m_node->m_queue);
         m_legit = true;
     }
     catch ( ... )
@@ -333,15 +576,21 @@ void Aton::change_port(int port)
     }
 
     // Success
-    if (m_server.connected())
+    if (m_listen_port != 0)
     {
+        // The new server holds the renders back like the last one did
+        IngestService& service = IngestService::instance();
+        service.set_control(m_listen_port, m_pause ? RENDER_PAUSE : RENDER_RUN);
+        service.set_auto_pause(m_listen_port, m_auto_pause);
+
+        m_node->m_checkpoint_writer.start();
         Thread::spawn(::fb_writer, 1, m_node);
 
         // Update port in the UI
-        if (m_port != m_server.get_port())
+        if (m_port != m_listen_port)
         {
             std::stringstream stream;
-            stream << (m_server.get_port());
+            stream << m_listen_port;
             std::string port = stream.str();
             knob("port_knob")->set_text(port.c_str());
         }
@@ -377,12 +626,38 @@ std::string Aton::get_path()
     return def_path;
 }
 
+std::string Aton::get_checkpoint_path(const long long& session,
+                                      const double& frame)
+{
+    // One file per frame, so a new iteration only starts its own over
+    using namespace boost::filesystem;
+    path filepath(m_node->m_path);
+    path file = (boost::format("%s_%s_%s%s")%filepath.stem().string()
+                                            %session%frame%CHECKPOINT_EXT).str();
+    std::string str_path = (filepath.parent_path() / file).string();
+    boost::replace_all(str_path, "\\", "/");
+    return str_path;
+}
+
+std::string Aton::get_cache_path()
+{
+    // Stored with the script so it finds its snapshots again
+    using namespace boost::filesystem;
+    if (m_node->m_cache_id.empty())
+        return "";
+    
+    std::string str_path = (path(SessionCache::root()) / m_node->m_cache_id).string();
+    boost::replace_all(str_path, "\\", "/");
+    return str_path;
+}
+
 // Disconnect the server for it's port
 void Aton::disconnect()
 {
-    if (m_server.connected())
+    if (m_listen_port != 0)
     {
-        m_server.quit();
+        IngestService::instance().unsubscribe(m_listen_port);
+        m_listen_port = 0;
         Thread::wait(m_node);
     }
 }
@@ -398,6 +673,69 @@ void Aton::flag_update(const Box& box)
     asapUpdate(box);
 }
 
+void Aton::wait_captures()
+{
+    while (m_node->m_captures > 0)
+        sleepFor(0.01);
+}
+
+void Aton::start_updater()
+{
+    // One updater per node, on the first op like the frames it's told about
+    FrameUpdate& update = m_node->m_update;
+    if (update.running)
+        return;
+    
+    update.node = m_node;
+    update.quit = false;
+    update.pending = false;
+    update.running = true;
+    Thread::spawn(::fb_updater, 1, &update);
+}
+
+void Aton::stop_updater()
+{
+    FrameUpdate& update = m_node->m_update;
+    if (!update.running)
+        return;
+    
+    update.lock.lock();
+    update.quit = true;
+    update.lock.signal();
+    update.lock.unlock();
+    
+    Thread::wait(&update);
+    update.running = false;
+}
+
+void Aton::request_flipbook()
+{
+    // Converted on the updater thread
+    if (!m_node->m_flipbook)
+        return;
+    
+    FrameUpdate& update = m_node->m_update;
+    update.lock.lock();
+    update.flipbook = true;
+    update.lock.signal();
+    update.lock.unlock();
+}
+
+void Aton::notify_frame(const int& output, const double& frame)
+{
+    // Called for every hash, only frame changes wake the updater
+    FrameUpdate& update = m_node->m_update;
+    update.lock.lock();
+    if (frame != update.frame || output != update.output)
+    {
+        update.frame = frame;
+        update.output = output;
+        update.pending = true;
+        update.lock.signal();
+    }
+    update.lock.unlock();
+}
+
 FrameBuffer* Aton::get_framebuffer(const long long& session)
 {
     std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
@@ -405,12 +743,24 @@ FrameBuffer* Aton::get_framebuffer(const long long& session)
     {
         std::vector<FrameBuffer>::iterator it;
         for(it = fbs.begin(); it != fbs.end(); ++it)
-            if (it->get_session() == session)
+            if (it->has_session(session))
                 return &(*it);
     }
     return NULL;
 }
 
+// Latest FrameBuffer still being rendered to, snapshots
+// are never written to again
+FrameBuffer* Aton::live_framebuffer()
+{
+    std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
+    std::vector<FrameBuffer>::reverse_iterator it;
+    for(it = fbs.rbegin(); it != fbs.rend(); ++it)
+        if (it->get_session() != 0)
+            return &(*it);
+    return NULL;
+}
+
 FrameBuffer* Aton::add_framebuffer()
 {
     std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
@@ -419,6 +769,16 @@ FrameBuffer* Aton::add_framebuffer()
     return &fbs.back();
 }
 
+// FrameBuffer at the given index of the outputs, resolved by
+// the caller on the main thread, NULL once it's gone
+FrameBuffer* Aton::output_framebuffer(const int& output)
+{
+    std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
+    if (output < 0 || output >= static_cast<int>(fbs.size()))
+        return NULL;
+    return &fbs[output];
+}
+
 FrameBuffer* Aton::current_framebuffer()
 {
     std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
@@ -448,6 +808,111 @@ RenderBuffer* Aton::current_renderbuffer()
         return NULL;
 }
 
+bool Aton::prepare_frame(const int& output, const double& frame)
+{
+    // Copying a paged out RenderBuffer is cheap, its planes are
+    // mapped through the copy so the lock is only held to swap them in
+    RenderBuffer paged;
+    {
+        ReadGuard lock(m_node->m_mutex);
+        FrameBuffer* fb = output_framebuffer(output);
+        if (fb == NULL || !fb->renderbuffer_exists(frame))
+            return false;
+        
+        // Plans are swapped in whole, the shared lock will do
+        RenderBuffer* rb = fb->get_renderbuffer(frame);
+        if (!rb->paged_out())
+        {
+            if (rb->has_read_plan(m_node->m_channels))
+                return false;
+            rb->build_read_plan(m_node->m_channels);
+            return true;
+        }
+        paged = *rb;
+    }
+    
+    std::vector<AOVBuffer> buffers;
+    SessionCache::read_planes(paged, buffers);
+    
+    // Resolved again, the FrameBuffers may have changed meanwhile
+    WriteGuard lock(m_node->m_mutex);
+    FrameBuffer* fb = output_framebuffer(output);
+    if (fb == NULL || !fb->renderbuffer_exists(frame))
+        return false;
+    
+    RenderBuffer* rb = fb->get_renderbuffer(frame);
+    if (!SessionCache::adopt(*rb, paged, buffers))
+        return false;
+    rb->build_read_plan(m_node->m_channels);
+    return true;
+}
+
+bool Aton::prepare_flipbook(const int& output, const double& frame)
+{
+    // Restored snapshots have to be paged in first
+    prepare_frame(output, frame);
+    
+    // Converted under the shared lock, only finished frames are
+    // taken so the ingest isn't writing to them meanwhile. Once the
+    // render is done with a frame its planes are paged out as well,
+    // the RGBA is played from the flipbook.
+    const std::string dir = get_cache_path();
+    FlipbookFrame flipbook;
+    std::vector<AOVBuffer> buffers;
+    bool convert;
+    int pass;
+    {
+        ReadGuard lock(m_node->m_mutex);
+        FrameBuffer* fb = output_framebuffer(output);
+        if (fb == NULL || !fb->renderbuffer_exists(frame))
+            return false;
+        
+        RenderBuffer* rb = fb->get_renderbuffer(frame);
+        const Box& window = rb->get_data_window();
+        const RenderColor* rgb = rb->get_aovs().empty() ? NULL : rb->get_color_data(0);
+        convert = !rb->get_flipbook().matches(window.w(), window.h());
+        const bool release = !rb->rendering() && !rb->mapped();
+        if (rgb == NULL || !rb->ready() || rb->paged_out() ||
+            (fb->get_session() != 0 && rb->get_progress() < 100) ||
+            (!convert && !release))
+            return false;
+        
+        if (convert)
+            flipbook.build(&rgb[0][0], rb->get_float_data(0), window.w(), window.h());
+        if (release)
+            SessionCache::page_out(dir, *fb, *rb, buffers);
+        pass = rb->get_pass();
+    }
+    
+    WriteGuard lock(m_node->m_mutex);
+    FrameBuffer* fb = output_framebuffer(output);
+    if (fb == NULL || !fb->renderbuffer_exists(frame))
+        return false;
+    
+    // Dropped if a render opened the frame again meanwhile
+    RenderBuffer* rb = fb->get_renderbuffer(frame);
+    const Box& window = rb->get_data_window();
+    if (rb->get_pass() != pass)
+        return false;
+    
+    if (convert && flipbook.matches(window.w(), window.h()))
+        rb->set_flipbook(flipbook);
+    if (!buffers.empty())
+        SessionCache::release(*rb, buffers);
+    return convert;
+}
+
+RenderBuffer* Aton::get_renderbuffer(const long long& session,
+                                     const double& frame)
+{
+    FrameBuffer* fb = get_framebuffer(session);
+    
+    if (fb != NULL && !fb->empty())
+        return fb->get_renderbuffer(frame);
+    else
+        return NULL;
+}
+
 int Aton::current_fb_index(bool direction)
 {
     Table_KnobI* outputKnob = m_node->m_outputKnob->tableKnob();
@@ -646,7 +1111,11 @@ void Aton::set_status(const long long& progress,
                       const double& frame,
                       const char* name,
                       const char* version,
-                      const char* samples)
+                      const char* samples,
+                      const bool& rendering,
+                      const int& preview_tiles,
+                      const int& downsampling,
+                      const int& buckets)
 {
     const int hour = time / 3600000;
     const int minute = (time % 3600000) / 60000;
@@ -667,71 +1136,131 @@ void Aton::set_status(const long long& progress,
                                                              %hour%minute%second%name
                                                              %frame%f_size%samples%progress).str();
     Knob* statusKnob = m_node->knob("status_knob");
-    if (m_node->m_running)
+    
+    // Tiles still waiting for their exact pixels
+    if (preview_tiles > 0)
+        status_str += (boost::format(" | Preview: %s tiles")%preview_tiles).str();
+    
+    // The link can't keep up, buckets land at a fraction of their resolution
+    if (downsampling > 1 && rendering)
+        status_str += (boost::format(" | Downsampled: %sx%s")%downsampling%downsampling).str();
+    
+    // Buckets the render got through so far
+    if (buckets > 0 && rendering)
+        status_str += (boost::format(" | Buckets: %s")%buckets).str();
+    
+    // Each frame of a multi-frame render reports on its own
+    if (rendering)
         status_str += "...";
     
-    bool disabled = (progress == 100) || !m_node->m_running;
+    bool disabled = (progress == 100) || !rendering;
     statusKnob->set_flag(Knob::DISABLED, disabled);
     statusKnob->set_text(status_str.c_str());
 }
 
 void Aton::multiframe_cmd()
 {
-    WriteGuard lock(m_node->m_mutex);
-    std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
-    
-    if (!fbs.empty())
     {
-        FrameBuffer* fb = current_framebuffer();
-        fb->set_frame(outputContext().frame());
+        WriteGuard lock(m_node->m_mutex);
+        std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
+        
+        if (!fbs.empty())
+        {
+            FrameBuffer* fb = current_framebuffer();
+            fb->set_frame(outputContext().frame());
+        }
     }
+    
+    // Show the buffer of the current frame right away
     if (m_node->m_multiframes)
-        Thread::spawn(::fb_updater, 1, m_node);
+    {
+        FrameUpdate& update = m_node->m_update;
+        update.lock.lock();
+        update.pending = true;
+        update.lock.signal();
+        update.lock.unlock();
+    }
 }
 
 void Aton::select_output_cmd(Table_KnobI* outputKnob)
 {
-    WriteGuard lock(m_node->m_mutex);
-    std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
-    
-    if (!fbs.empty())
+    bool renamed = false;
     {
-        FrameBuffer* fb = current_framebuffer();
+        WriteGuard lock(m_node->m_mutex);
+        std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
         
-        // Check if item has renamed from UI
-        int idx = outputKnob->getSelectedRow();
-        
-        if (idx >= 0 && m_node->m_output_changed == Aton::item_not_changed)
+        if (!fbs.empty())
         {
-            std::string row_name = outputKnob->getCellString(idx, 0);
-            if (row_name != fb->get_output_name())
-                fb->set_output_name(row_name);
+            FrameBuffer* fb = current_framebuffer();
+            
+            // Check if item has renamed from UI
+            int idx = outputKnob->getSelectedRow();
+            
+            if (idx >= 0 && m_node->m_output_changed == Aton::item_not_changed)
+            {
+                std::string row_name = outputKnob->getCellString(idx, 0);
+                if (row_name != fb->get_output_name())
+                {
+                    fb->set_output_name(row_name);
+                    renamed = true;
+                }
+            }
+            flag_update();
         }
-        flag_update();
     }
+    
+    // The cache index keeps the names
+    if (renamed)
+        save_cache_index();
 }
 
 void Aton::snapshot_cmd()
 {
-    WriteGuard lock(m_node->m_mutex);
-    std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
-    if (!fbs.empty())
+    // Copy the pixels under the shared lock so neither
+    // the viewer nor the ingest thread have to wait for it
+    FrameBuffer snapshot;
+    {
+        ReadGuard lock(m_node->m_mutex);
+        if (m_node->m_framebuffers.empty())
+            return;
+        snapshot = *current_framebuffer();
+    }
+    snapshot.set_session(0);
+    
+    // Nothing writes to the copy
+    std::vector<RenderBuffer>& rbs = snapshot.get_renderbuffers();
+    std::vector<RenderBuffer>::iterator it;
+    for(it = rbs.begin(); it != rbs.end(); ++it)
+        it->set_rendering(false);
+    
+    // Cached right away so a crash doesn't lose it,
+    // written from the copy without holding the lock
+    if (m_node->m_cache_restored)
+        SessionCache::store(get_cache_path(), snapshot);
+    
     {
+        WriteGuard lock(m_node->m_mutex);
+        std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
+        if (fbs.empty())
+            return;
+        
         int fb_index = current_fb_index(false);
         fb_index = fb_index > 0 ? fb_index-- : 0;
-        fbs.insert(fbs.begin() + fb_index, *current_framebuffer());
-        fbs[fb_index].set_session(0);
+        fbs.insert(fbs.begin() + fb_index, snapshot);
         m_node->m_output_changed = Aton::item_copied;
         flag_update();
     }
+    save_cache_index();
 }
 
 void Aton::move_cmd(bool direction)
 {
-    WriteGuard lock(m_node->m_mutex);
-    std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
-    if (!fbs.empty())
     {
+        WriteGuard lock(m_node->m_mutex);
+        std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
+        if (fbs.empty())
+            return;
+        
         int idx = m_node->current_fb_index(false);
         if (direction && idx < (fbs.size()-1))
         {
@@ -745,14 +1274,17 @@ void Aton::move_cmd(bool direction)
         }
         flag_update();
     }
+    save_cache_index();
 }
 
 void Aton::remove_selected_cmd()
 {
-    WriteGuard lock(m_node->m_mutex);
-    std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
-    if (!fbs.empty() && !m_node->m_running)
     {
+        WriteGuard lock(m_node->m_mutex);
+        std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
+        if (fbs.empty() || m_node->m_running)
+            return;
+        
         int idx = m_node->current_fb_index(false);
         current_renderbuffer()->set_ready(false);
         m_node->m_output_changed = Aton::item_removed;
@@ -763,6 +1295,7 @@ void Aton::remove_selected_cmd()
 
         flag_update();
     }
+    save_cache_index();
 }
 
 void Aton::copy_region_cmd()
@@ -826,7 +1359,7 @@ void Aton::capture_cmd()
     ReadGuard lock(m_node->m_mutex);
     std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
 
-    if (!fbs.empty() && path_valid(m_path))
+    if (!fbs.empty() && !current_framebuffer()->empty() && path_valid(m_path))
     {
         // Add date or frame suffix to the path
         std::string key (".");
@@ -865,6 +1398,41 @@ void Aton::capture_cmd()
         if (found != std::string::npos)
             path.replace(found, key.length(), timeFrameSuffix);
 
+#ifdef ATON_OPENEXR
+        // Nothing rendered to the frame yet
+        RenderBuffer* rb = current_renderbuffer();
+        if (rb == NULL || rb->empty())
+            return;
+        
+        // Write the frames on our own thread, it reads them
+        // from the buffers as it goes
+        CaptureJob* job = new CaptureJob;
+        job->node = m_node;
+        job->output = current_fb_index(false);
+        job->output_name = fb->get_output_name();
+        job->read_path = path;
+        job->first_frame = startFrame;
+        job->last_frame = endFrame;
+        if (m_multiframes && m_write_frames)
+        {
+            std::vector<double>::iterator it;
+            for(it = sortedFrames.begin(); it != sortedFrames.end(); ++it)
+            {
+                std::string frame_path = path;
+                const std::string padding = (boost::format("%04d")%static_cast<int>(*it)).str();
+                boost::replace_all(frame_path, "####", padding);
+                job->paths.push_back(frame_path);
+                job->frames.push_back(*it);
+            }
+        }
+        else
+        {
+            job->paths.push_back(path);
+            job->frames.push_back(rb->get_frame());
+        }
+        ++m_node->m_captures;
+        Thread::spawn(::fb_capture, 1, job);
+#else
         std::string cmd; // Our python command buffer
         // Create a Write node and return it's name
         cmd = (boost::format("nuke.nodes.Write(file='%s').name()")%path.c_str()).str();
@@ -902,6 +1470,7 @@ void Aton::capture_cmd()
                                                                               %frames).str();
         script_command(cmd.c_str(), true, false);
         script_unlock();
+#endif
     }
 }
 
@@ -939,6 +1508,104 @@ void Aton::import_cmd(bool all)
     }
 }
 
+// Escape the characters a regex would take for operators
+static std::string escape_regex(const std::string& str)
+{
+    static const boost::regex special("[.^$|()\\[\\]{}*+?\\\\]");
+    return boost::regex_replace(str, special, "\\\\$&");
+}
+
+void Aton::recover_cmd()
+{
+    // Find the latest checkpointed session next to the capture path
+    using namespace boost::filesystem;
+    if (!path_valid(m_path))
+        return;
+    
+    path filepath(m_path);
+    std::string exp = (boost::format("%s_(\\d+)_.+\\%s")%escape_regex(filepath.stem().string())
+                                                        %CHECKPOINT_EXT).str();
+    const boost::regex filter(exp);
+    
+    // Checkpoints by session, one per frame
+    std::multimap<std::string, path> files;
+    std::string latest;
+    std::time_t latest_time = 0;
+    directory_iterator it(filepath.parent_path());
+    BOOST_FOREACH(path const& p, std::make_pair(it, directory_iterator()))
+    {
+        boost::smatch what;
+        const std::string name = p.filename().string();
+        if (is_regular_file(p) && boost::regex_match(name, what, filter))
+        {
+            files.insert(std::make_pair(what[1].str(), p));
+            if (last_write_time(p) >= latest_time)
+            {
+                latest = what[1].str();
+                latest_time = last_write_time(p);
+            }
+        }
+    }
+    
+    if (latest.empty())
+        return;
+    
+    // Replay the frames of the session into a new snapshot
+    FrameBuffer fb;
+    bool restored = false;
+    std::multimap<std::string, path>::iterator file;
+    for(file = files.lower_bound(latest); file != files.upper_bound(latest); ++file)
+        restored = read_checkpoint(file->second.string(), fb) || restored;
+    
+    if (!restored)
+    {
+        std::cerr << "Aton: Could not recover session " << latest << std::endl;
+        return;
+    }
+    fb.set_session(0);
+    
+    if (m_node->m_cache_restored)
+        SessionCache::store(get_cache_path(), fb);
+    
+    {
+        WriteGuard lock(m_node->m_mutex);
+        m_node->m_framebuffers.push_back(fb);
+        m_node->m_output_changed = Aton::item_added;
+        flag_update();
+    }
+    save_cache_index();
+}
+
+void Aton::restore_cache()
+{
+    m_node->m_cache_restored = true;
+    
+    // Left behind if Nuke didn't close properly
+    SessionCache::drop_pages(get_cache_path());
+    
+    // Only the headers are read here
+    std::vector<FrameBuffer> fbs;
+    SessionCache::load(get_cache_path(), fbs);
+    if (fbs.empty())
+        return;
+    
+    WriteGuard lock(m_node->m_mutex);
+    m_node->m_framebuffers.insert(m_node->m_framebuffers.end(),
+                                  fbs.begin(), fbs.end());
+    m_node->m_output_changed = Aton::item_added;
+}
+
+void Aton::save_cache_index()
+{
+    // Snapshot files are written as they are taken, the index only
+    // holds their order and names so the shared lock will do
+    if (!m_node->m_cache_restored)
+        return;
+    
+    ReadGuard lock(m_node->m_mutex);
+    SessionCache::save_index(get_cache_path(), m_node->m_framebuffers);
+}
+
 void Aton::live_camera_toogle()
 {
     // Our python command buffer
@@ -13,11 +13,27 @@ All rights reserved. See COPYING.txt for more details.
 #include <DDImage/Thread.h>
 #include <DDImage/Version.h>
 #include <DDImage/TableKnobI.h>
+#ifdef ATON_PLANAR
+#include <DDImage/PlanarIop.h>
+#endif
+#include <boost/atomic.hpp>
 
 using namespace DD::Image;
 
+// Base of the node, the planar one fills whole stripes
+// of the viewer under one lock rather than single rows
+#ifdef ATON_PLANAR
+typedef PlanarIop AtonIop;
+#else
+typedef Iop AtonIop;
+#endif
+
 #include "aton_client.h"
-#include "aton_server.h"
+#include "aton_pool.h"
+#include "aton_checkpoint.h"
+#include "aton_cache.h"
+#include "aton_queue.h"
+#include "aton_service.h"
 #include "aton_framebuffer.h"
 
 // Class name
@@ -45,65 +61,106 @@ std::string get_date()
     return std::string(time_buffer);
 }
 
+class Aton;
+
+// Frame changes handed from the node to the updater thread
+struct FrameUpdate
+{
+    FrameUpdate(): node(NULL), frame(0), output(0), flipbook(false),
+                   quit(false), running(false), pending(false) {}
+    
+    Aton* node;
+    SignalLock lock;
+    double frame;       // Last frame the node was evaluated at
+    int output;         // FrameBuffer viewed, resolved by the node
+    bool flipbook;      // Finished frames to convert for the flipbook
+    bool quit;
+    bool running;
+    
+    // Frame changed since the updater last ran, also
+    // polled without the lock to cut the prefetch short
+    boost::atomic<bool> pending;
+};
+
 // Nuke node
-class Aton: public Iop
+class Aton: public AtonIop
 {
     public:
         Aton*                     m_node;               // First node pointer
-        Server                    m_server;             // Aton::Server
+        IngestQueue               m_queue;              // Reader to writer thread queue
+        CheckpointWriter          m_checkpoint_writer;  // Streams buckets to disk
+        FrameUpdate               m_update;             // Wakes the updater thread
         ReadWriteLock             m_mutex;              // Mutex for locking the pixel buffer
         Format                    m_fmt;                // The nuke display format
         FormatPair                m_fmtp;               // Buffer format (knob)
         ChannelSet                m_channels;           // Channels aka AOVs object
         int                       m_port;               // Port we're listening on (knob)
-        int                       m_output_changed;     // If Snapshots needs to be updated
+        int                       m_listen_port;        // Port subscribed to the IngestService
         float                     m_cam_fov;            // Default Camera fov
         float                     m_cam_matrix;         // Default Camera matrix value
+        float                     m_auto_pause;         // Seconds unseen before the render pauses (knob)
+        int                       m_output_changed;     // If Snapshots needs to be updated
         bool                      m_multiframes;        // Enable Multiple Frames toogle
-        bool                      m_write_frames;       // Write AOVs
+        bool                      m_flipbook;           // Play finished frames from the flipbook
+        bool                      m_region_update;      // Composite region renders onto the last frame
         bool                      m_enable_aovs;        // Enable AOVs toogle
         bool                      m_live_camera;        // Enable Live Camera toogle
+        bool                      m_pause;              // Hold the render back (knob)
+        bool                      m_write_frames;       // Write AOVs
+        bool                      m_checkpoint;         // Checkpoint renders to disk toogle
         bool                      m_inError;            // Error handling
         bool                      m_format_exists;      // If the format was already exist
         bool                      m_capturing;          // Capturing signal
         bool                      m_legit;              // Used to throw the threads
-        bool                      m_running;            // Thread Rendering
+        boost::atomic<bool>       m_running;            // Thread Rendering, read without the lock
+        boost::atomic<int>        m_captures;           // Capture threads still reading the buffers
+        bool                      m_cache_restored;     // Session cache was loaded
         unsigned int              m_hash_count;         // Refresh hash counter
         const char*               m_path;               // Default path for Write node
         double                    m_region[4];          // Render Region Data
         std::string               m_node_name;          // Node name
         std::string               m_status;             // Status bar text
+        std::string               m_cache_id;           // Session cache directory (knob)
         std::string               m_connection_error;   // Connection error report
         Knob*                     m_outputKnob;         // Shapshots Knob
         std::vector<FrameBuffer>  m_framebuffers;       // Framebuffers List
 
-        Aton(Node* node): Iop(node),
+        Aton(Node* node): AtonIop(node),
                           m_node(first_node()),
                           m_fmt(Format(0, 0, 1.0)),
                           m_channels(Mask_RGBA),
                           m_port(get_port()),
+                          m_listen_port(0),
                           m_cam_fov(0),
                           m_cam_matrix(0),
+                          m_auto_pause(0),
                           m_output_changed(0),
                           m_multiframes(false),
+                          m_flipbook(false),
+                          m_region_update(false),
                           m_enable_aovs(true),
                           m_live_camera(false),
+                          m_pause(false),
                           m_write_frames(false),
+                          m_checkpoint(false),
                           m_inError(false),
                           m_format_exists(false),
                           m_capturing(false),
                           m_legit(false),
                           m_running(false),
+                          m_captures(0),
+                          m_cache_restored(false),
                           m_path(""),
                           m_node_name(""),
                           m_status(""),
+                          m_cache_id(""),
                           m_connection_error("")
         {
             inputs(0);
             m_region[0] = m_region[1] = m_region[2] =  m_region[3] = 0.0f;
         }
 
-        ~Aton() { disconnect(); }
+        ~Aton() { disconnect(); stop_updater(); wait_captures(); }
         
         Aton* first_node() { return dynamic_cast<Aton*>(firstOp()); }
     
@@ -112,7 +169,14 @@ class Aton: public Iop
         void append(Hash& hash);
 
         void _validate(bool for_real);
+        void _request(int x, int y, int r, int t, ChannelMask channels, int count);
+#ifdef ATON_PLANAR
+        void renderStripe(ImagePlane& plane);
+        bool useStripes() const { return true; }
+        PackedPreference packedPreference() const { return ePackedPreferenceUnpacked; }
+#else
         void engine(int y, int x, int r, ChannelMask channels, Row& out);
+#endif
         void knobs(Knob_Callback f);
         int knob_changed(Knob* _knob);
     
@@ -128,15 +192,37 @@ class Aton: public Iop
     
         int get_port();
         std::string get_path();
+        std::string get_checkpoint_path(const long long& session,
+                                        const double& frame);
+        std::string get_cache_path();
     
         void disconnect();
         void change_port(int port);
         void flag_update(const Box& box = Box(0,0,0,0));
+    
+        void start_updater();
+        void stop_updater();
+        void wait_captures();
+        void notify_frame(const int& output, const double& frame);
+        void request_flipbook();
 
         FrameBuffer* add_framebuffer();
         FrameBuffer* current_framebuffer();
+        FrameBuffer* output_framebuffer(const int& output);
         FrameBuffer* get_framebuffer(const long long& session);
+        FrameBuffer* live_framebuffer();
         RenderBuffer* current_renderbuffer();
+        RenderBuffer* readable_renderbuffer();
+        void read_pixels(RenderBuffer* rb,
+                         const int& y,
+                         const int& x,
+                         const int& r,
+                         const Channel& z,
+                         float* out);
+        RenderBuffer* get_renderbuffer(const long long& session,
+                                       const double& frame);
+        bool prepare_frame(const int& output, const double& frame);
+        bool prepare_flipbook(const int& output, const double& frame);
 
         int current_fb_index(bool direction = true);
     
@@ -157,7 +243,11 @@ class Aton: public Iop
                         const double& frame = 0,
                         const char* version = "",
                         const char* samples = "",
-                        const char* output = "");
+                        const char* output = "",
+                        const bool& rendering = false,
+                        const int& preview_tiles = 0,
+                        const int& downsampling = 1,
+                        const int& buckets = 0);
     
         void live_camera_toogle();
         bool path_valid(std::string path);
@@ -171,6 +261,9 @@ class Aton: public Iop
         void copy_region_cmd();
         void capture_cmd();
         void import_cmd(bool all);
+        void recover_cmd();
+        void restore_cache();
+        void save_cache_index();
     
         bool firstEngineRendersWholeRequest() const { return true; }
         const char* Class() const { return CLASS; }
@@ -0,0 +1,140 @@
+/*
+Copyright (c) 2018,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_pool.h"
+#include <algorithm>
+
+// Keep the pool small, the viewer needs the rest
+const int MAX_WORKERS = 8;
+
+WorkerPool::WorkerPool(): _threads(0),
+                          _quit(false) {}
+
+WorkerPool::~WorkerPool() { stop(); }
+
+void WorkerPool::start(int threads)
+{
+    if (_threads > 0)
+        return;
+    
+    // Leave a core for the caller
+    if (threads <= 0)
+        threads = std::min(Thread::numCPUs - 1, MAX_WORKERS);
+    if (threads <= 0)
+        return;
+    
+    _quit = false;
+    _threads = threads;
+    Thread::spawn(worker, _threads, this);
+}
+
+void WorkerPool::stop()
+{
+    if (_threads == 0)
+        return;
+    
+    _wake.lock();
+    _quit = true;
+    _wake.signal();
+    _wake.unlock();
+    
+    Thread::wait(this);
+    _threads = 0;
+}
+
+void WorkerPool::run(PoolTask* task,
+                     void* data,
+                     const int& count,
+                     const int& priority)
+{
+    Job job;
+    job.task = task;
+    job.data = data;
+    job.count = count;
+    job.priority = priority;
+    job.next = 0;
+    job.users = 0;
+    
+    // Not worth waking anyone
+    if (_threads == 0 || count < 2)
+    {
+        work(&job);
+        return;
+    }
+    
+    _wake.lock();
+    _jobs.push_back(&job);
+    _wake.signal();
+    _wake.unlock();
+    
+    work(&job);
+    
+    // Take the job back so no more workers join it
+    _wake.lock();
+    _jobs.erase(std::find(_jobs.begin(), _jobs.end(), &job));
+    _wake.unlock();
+    
+    // Wait for the workers still running its tasks
+    job.done.lock();
+    while (job.users > 0)
+        job.done.wait();
+    job.done.unlock();
+}
+
+void WorkerPool::work(Job* job)
+{
+    int index;
+    while ((index = job->next.fetch_add(1)) < job->count)
+        job->task(index, job->data);
+}
+
+WorkerPool::Job* WorkerPool::next_job()
+{
+    Job* next = NULL;
+    std::vector<Job*>::iterator it;
+    for(it = _jobs.begin(); it != _jobs.end(); ++it)
+    {
+        if ((*it)->next < (*it)->count &&
+            (next == NULL || (*it)->priority > next->priority))
+            next = *it;
+    }
+    return next;
+}
+
+void WorkerPool::worker(unsigned index, unsigned nthreads, void* data)
+{
+    WorkerPool* pool = reinterpret_cast<WorkerPool*>(data);
+    
+    while (true)
+    {
+        Job* job;
+        pool->_wake.lock();
+        while (!pool->_quit && (job = pool->next_job()) == NULL)
+            pool->_wake.wait();
+        
+        if (pool->_quit)
+        {
+            // Pass it on to the next sleeping worker
+            pool->_wake.signal();
+            pool->_wake.unlock();
+            return;
+        }
+        
+        ++job->users;
+        
+        // Wake another worker while there is work left
+        if (job->next < job->count || pool->next_job() != NULL)
+            pool->_wake.signal();
+        pool->_wake.unlock();
+        
+        work(job);
+        
+        job->done.lock();
+        --job->users;
+        job->done.signal();
+        job->done.unlock();
+    }
+}
@@ -0,0 +1,82 @@
+/*
+Copyright (c) 2018,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_POOL_H_
+#define ATON_POOL_H_
+
+#include <DDImage/Thread.h>
+#include <vector>
+#include <boost/atomic.hpp>
+
+using namespace DD::Image;
+
+// Task run by the pool once for every index of a job
+typedef void PoolTask(const int& index, void* data);
+
+// Small pool of worker threads to split large jobs on.
+// Idle workers pick the next unclaimed index of the most urgent job,
+// the calling thread takes part too and returns once all are done.
+// Several threads may run jobs on the same pool at once.
+// The tasks of a job are about the same size, a band of tile rows of
+// one AOV, so the indices are handed out from one shared counter
+// rather than split into deques per worker to steal from. A claim is
+// one atomic add, and no worker is left holding a backlog of its own.
+class WorkerPool
+{
+public:
+    WorkerPool();
+    ~WorkerPool();
+    
+    // Spawn the workers, threads <= 0 uses the number of CPUs
+    void start(int threads = 0);
+    
+    // Wake and join the workers
+    void stop();
+    
+    // Number of threads sharing the work, the caller included
+    int size() const { return _threads + 1; }
+    
+    // Run task for every index in [0, count), blocks until done.
+    // Workers serve jobs of a higher priority first.
+    void run(PoolTask* task,
+             void* data,
+             const int& count,
+             const int& priority = 0);
+    
+private:
+    // A job lives on the stack of run()
+    struct Job
+    {
+        PoolTask* task;
+        void* data;
+        int count;
+        int priority;
+        boost::atomic<int> next;
+        boost::atomic<int> users;
+        
+        // run() waits on it for the workers to leave
+        SignalLock done;
+    };
+    
+    static void worker(unsigned index, unsigned nthreads, void* data);
+    
+    // Claim and run indices until the job is exhausted
+    static void work(Job* job);
+    
+    // Most urgent job with indices left, guarded by _wake
+    Job* next_job();
+    
+    int _threads;
+    bool _quit;
+    
+    // Running jobs, guarded by _wake
+    std::vector<Job*> _jobs;
+    
+    // Workers sleep on _wake
+    SignalLock _wake;
+};
+
+#endif // ATON_POOL_H_
@@ -0,0 +1,108 @@
+/*
+Copyright (c) 2018,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_queue.h"
+
+boost::atomic<size_t> IngestQueue::_in_flight(0);
+
+IngestQueue::IngestQueue(const size_t& depth): _pool(depth),
+                                               _free(depth),
+                                               _ready(depth),
+                                               _free_waiting(false),
+                                               _ready_waiting(false)
+{
+    std::vector<IngestMessage>::iterator it;
+    for(it = _pool.begin(); it != _pool.end(); ++it)
+        _free.push(&(*it));
+}
+
+IngestMessage* IngestQueue::acquire()
+{
+    IngestMessage* msg;
+    if (_free.pop(msg))
+        return msg;
+    
+    // Every message is in flight, wait for the writer
+    _free_signal.lock();
+    _free_waiting = true;
+    boost::atomic_thread_fence(boost::memory_order_seq_cst);
+    while (!_free.pop(msg))
+        _free_signal.wait();
+    _free_waiting = false;
+    _free_signal.unlock();
+    return msg;
+}
+
+IngestMessage* IngestQueue::try_acquire()
+{
+    IngestMessage* msg;
+    if (_free.pop(msg))
+        return msg;
+    return NULL;
+}
+
+void IngestQueue::push(IngestMessage* msg)
+{
+    _in_flight += msg->bytes;
+    _ready.push(msg);
+    
+    // The message is out before the flag is read, and the waiting
+    // side sets the flag before it looks again, one of them sees
+    // the other and the wakeup isn't lost
+    boost::atomic_thread_fence(boost::memory_order_seq_cst);
+    if (_ready_waiting)
+    {
+        _ready_signal.lock();
+        _ready_signal.signal();
+        _ready_signal.unlock();
+    }
+}
+
+IngestMessage* IngestQueue::pop()
+{
+    IngestMessage* msg;
+    if (_ready.pop(msg))
+        return msg;
+    
+    // Nothing to apply, wait for the reader
+    _ready_signal.lock();
+    _ready_waiting = true;
+    boost::atomic_thread_fence(boost::memory_order_seq_cst);
+    while (!_ready.pop(msg))
+        _ready_signal.wait();
+    _ready_waiting = false;
+    _ready_signal.unlock();
+    return msg;
+}
+
+IngestMessage* IngestQueue::try_pop()
+{
+    IngestMessage* msg;
+    if (_ready.pop(msg))
+        return msg;
+    return NULL;
+}
+
+void IngestQueue::release(IngestMessage* msg)
+{
+    // Deallocate the names read with the message
+    msg->header.free();
+    msg->pixels.free();
+    
+    _in_flight -= msg->bytes;
+    msg->bytes = 0;
+    
+    _free.push(msg);
+    
+    // Ordered against the flag like push
+    boost::atomic_thread_fence(boost::memory_order_seq_cst);
+    if (_free_waiting)
+    {
+        _free_signal.lock();
+        _free_signal.signal();
+        _free_signal.unlock();
+    }
+}
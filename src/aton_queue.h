@@ -0,0 +1,80 @@
+/*
+Copyright (c) 2018,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_QUEUE_H_
+#define ATON_QUEUE_H_
+
+#include <DDImage/Thread.h>
+#include <boost/atomic.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+#include "aton_client.h"
+
+using namespace DD::Image;
+
+// Message type pushed by the reader when the connection is gone
+const int DISCONNECTED = -1;
+
+// Pixel bytes all the nodes may have queued before reading pauses
+const size_t INGEST_BUDGET = 1024 * 1048576;
+
+// One message read from the socket, recycled through the queue
+struct IngestMessage
+{
+    IngestMessage(): type(0), stream(0), bytes(0) {}
+    
+    int type;
+    
+    // Connection it was read from
+    int stream;
+    DataHeader header;
+    DataPixels pixels;
+    RenderStats stats;
+    
+    // Pixel payload, counted against the global budget while queued
+    size_t bytes;
+};
+
+// Bounded single producer, single consumer queue between the socket
+// reader and the framebuffer writer. Messages are preallocated and
+// handed back and forth, so the pixel storage is reused. The reader
+// stops reading the socket once every message is in flight, which
+// pushes back on the driver.
+class IngestQueue
+{
+public:
+    IngestQueue(const size_t& depth = 64);
+    
+    // Reader side, get an empty message and publish it once filled
+    IngestMessage* acquire();
+    IngestMessage* try_acquire();
+    void push(IngestMessage* msg);
+    
+    // Writer side, get the next message and hand it back once applied
+    IngestMessage* pop();
+    IngestMessage* try_pop();
+    void release(IngestMessage* msg);
+    
+    // Pixel bytes queued and not yet applied, across all queues
+    static size_t in_flight() { return _in_flight; }
+    
+private:
+    static boost::atomic<size_t> _in_flight;
+    
+    // Message storage, never resized
+    std::vector<IngestMessage> _pool;
+    
+    // Lock free hand over in both directions
+    boost::lockfree::spsc_queue<IngestMessage*> _free;
+    boost::lockfree::spsc_queue<IngestMessage*> _ready;
+    
+    // Only used to sleep while the other side catches up
+    SignalLock _free_signal;
+    SignalLock _ready_signal;
+    boost::atomic<bool> _free_waiting;
+    boost::atomic<bool> _ready_waiting;
+};
+
+#endif // ATON_QUEUE_H_
@@ -6,21 +6,40 @@ All rights reserved. See COPYING.txt for more details.
 
 #include "aton_server.h"
 #include "aton_client.h"
+#include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
+#include <algorithm>
 
 using namespace boost::asio;
 
-Server::Server(): mPort(0),
-                  mSocket(mIoService),
-                  mAcceptor(mIoService)
+// Fixed size part of the messages following the type
+const size_t HEADER_SIZE = sizeof(long long) * 2 + sizeof(int) * 4 + sizeof(float) * 2 +
+                           sizeof(float) * 16 + sizeof(int) * 6 + sizeof(int) * 4 +
+                           sizeof(long long) + sizeof(int) + sizeof(size_t);
+const size_t PIXELS_INFO_SIZE = sizeof(int) * 9 + sizeof(size_t);
+const size_t STATS_SIZE = sizeof(int) * 2 + sizeof(long long) * 2 + sizeof(int) * 2;
+
+// Copy the next field out of the read buffer
+template <typename T>
+static void take(const char*& ptr, T& value)
 {
+    memcpy(&value, ptr, sizeof(T));
+    ptr += sizeof(T);
 }
 
-Server::Server(int port): mPort(0),
-                          mSocket(mIoService),
-                          mAcceptor(mIoService)
+Server::Server(io_service& io_service, IngestQueue& queue): mPort(0),
+                                                            mQueue(queue),
+                                                            mClosed(false),
+                                                            mNextStream(1),
+                                                            mPaused(false),
+                                                            mIdle(false),
+                                                            mAutoPause(0),
+                                                            mControl(RENDER_RUN),
+                                                            mIoService(io_service),
+                                                            mAcceptor(io_service),
+                                                            mIdleTimer(io_service),
+                                                            mRetry(io_service)
 {
-    connect(port);
 }
 
 Server::~Server()
@@ -72,114 +91,812 @@ void Server::connect(int port, bool search)
     }
 }
 
-void Server::quit()
+void Server::start()
+{
+    mLastView = boost::posix_time::microsec_clock::universal_time();
+    accept();
+    wait_idle();
+}
+
+void Server::close()
 {
-    std::string hostname("localhost");
-    Client client(hostname, mPort);
-    client.quit();
+    if (mClosed)
+        return;
+    mClosed = true;
+
+    error_code ec;
+    mAcceptor.close(ec);
+    mIdleTimer.cancel(ec);
+
+    // Every stream is let go before the writer quits
+    std::set<boost::shared_ptr<Connection> > connections;
+    connections.swap(mConnections);
+    std::set<boost::shared_ptr<Connection> >::iterator it;
+    for(it = connections.begin(); it != connections.end(); ++it)
+    {
+        (*it)->close();
+        if ((*it)->pending())
+            mClosing.insert(*it);
+    }
+    push_quit();
+}
+
+void Server::push_quit()
+{
+    // Neither the io thread nor the other nodes wait for the writer,
+    // retried until the streams are let go and a message is free
+    std::set<boost::shared_ptr<Connection> >::iterator it = mClosing.begin();
+    while (it != mClosing.end())
+    {
+        if ((*it)->pending())
+            break;
+        mClosing.erase(it++);
+    }
+
+    IngestMessage* msg = NULL;
+    if (mClosing.empty())
+        msg = mQueue.try_acquire();
+
+    if (msg == NULL)
+    {
+        mRetry.expires_from_now(boost::posix_time::milliseconds(1));
+        mRetry.async_wait(boost::bind(&Server::on_quit,
+                                      shared_from_this(),
+                                      placeholders::error));
+        return;
+    }
+
+    msg->type = 9;
+    msg->stream = 0;
+    mQueue.push(msg);
+}
+
+void Server::on_quit(const error_code& error)
+{
+    if (!error)
+        push_quit();
 }
 
 void Server::accept()
 {
-    if (mSocket.is_open())
-        mSocket.close();
-    mAcceptor.accept(mSocket);
+    boost::shared_ptr<Connection> connection(new Connection(shared_from_this(), mNextStream++));
+    mAcceptor.async_accept(connection->socket(), boost::bind(&Server::on_accept,
+                                                             shared_from_this(),
+                                                             connection,
+                                                             placeholders::error));
 }
 
-int Server::listen_type()
+void Server::on_accept(boost::shared_ptr<Connection> connection, const error_code& error)
 {
-    int type;
+    if (mClosed)
+        return;
+
+    // Keep accepting while this one is read. A new render gets
+    // the whole idle period to be looked at.
+    if (!error)
+    {
+        mLastView = boost::posix_time::microsec_clock::universal_time();
+        mConnections.insert(connection);
+        connection->start();
+    }
+    accept();
+}
+
+void Server::set_region(const ViewRegion& region)
+{
+    if (region == mRegion)
+        return;
+    mRegion = region;
     
-    try
+    std::set<boost::shared_ptr<Connection> >::iterator it;
+    for(it = mConnections.begin(); it != mConnections.end(); ++it)
+        (*it)->send_region(mRegion);
+}
+
+void Server::set_subscription(const AovSubscription& subscription)
+{
+    if (subscription == mSubscription)
+        return;
+    mSubscription = subscription;
+    
+    std::set<boost::shared_ptr<Connection> >::iterator it;
+    for(it = mConnections.begin(); it != mConnections.end(); ++it)
+        (*it)->send_subscription(mSubscription);
+}
+
+void Server::set_paused(const bool& paused)
+{
+    mPaused = paused;
+    update_control();
+}
+
+void Server::abort()
+{
+    std::set<boost::shared_ptr<Connection> >::iterator it;
+    for(it = mConnections.begin(); it != mConnections.end(); ++it)
+        (*it)->send_control(RENDER_ABORT);
+}
+
+void Server::set_auto_pause(const double& seconds)
+{
+    mAutoPause = seconds;
+    if (mAutoPause <= 0 && mIdle)
+    {
+        mIdle = false;
+        update_control();
+    }
+}
+
+void Server::keep_alive()
+{
+    mLastView = boost::posix_time::microsec_clock::universal_time();
+    if (mIdle)
     {
-        read(mSocket, buffer(reinterpret_cast<char*>(&type), sizeof(int)));
+        mIdle = false;
+        update_control();
+    }
+}
+
+void Server::remove(boost::shared_ptr<Connection> connection)
+{
+    mConnections.erase(connection);
+    if (connection->pending())
+        mClosing.insert(connection);
+}
+
+void Server::wait_idle()
+{
+    mIdleTimer.expires_from_now(boost::posix_time::seconds(1));
+    mIdleTimer.async_wait(boost::bind(&Server::on_idle,
+                                      shared_from_this(),
+                                      placeholders::error));
+}
+
+void Server::on_idle(const error_code& error)
+{
+    if (mClosed || error)
+        return;
     
-        if (type == 2 || type == 9)
-        {
-            mSocket.close();
-            if (type == 9)
-                mAcceptor.close();
-        }
+    using namespace boost::posix_time;
+    const double seconds = (microsec_clock::universal_time() - mLastView).total_milliseconds() / 1000.0;
+    if (mAutoPause > 0 && !mIdle && !mConnections.empty() && seconds > mAutoPause)
+    {
+        mIdle = true;
+        update_control();
     }
-    catch( ... )
+    wait_idle();
+}
+
+RenderControl Server::control() const
+{
+    return mPaused || mIdle ? RENDER_PAUSE : RENDER_RUN;
+}
+
+void Server::update_control()
+{
+    if (control() == mControl)
+        return;
+    mControl = control();
+    
+    std::set<boost::shared_ptr<Connection> >::iterator it;
+    for(it = mConnections.begin(); it != mConnections.end(); ++it)
+        (*it)->send_control(mControl);
+}
+
+
+Connection::Connection(boost::shared_ptr<Server> server, const int& stream): mServer(server),
+                                                                             mStream(stream),
+                                                                             mClosed(false),
+                                                                             mMultiplexed(false),
+                                                                             mClientStream(0),
+                                                                             mMsg(NULL),
+                                                                             mNameSize(0),
+                                                                             mType(0),
+                                                                             mOpen(false),
+                                                                             mWriting(false),
+                                                                             mRegionPending(false),
+                                                                             mSubscriptionPending(false),
+                                                                             mControl(RENDER_RUN),
+                                                                             mControlPending(false),
+                                                                             mAbortPending(false),
+                                                                             mSocket(server->mIoService),
+                                                                             mRetry(server->mIoService)
+{
+}
+
+void Connection::start()
+{
+    read_type();
+}
+
+void Connection::close()
+{
+    if (mClosed)
+        return;
+    mClosed = true;
+
+    error_code ec;
+    mRetry.cancel(ec);
+    mSocket.close(ec);
+
+    // Connection is closed, let the writer know
+    if (!mMultiplexed)
+        push(DISCONNECTED);
+    
+    std::map<int, int>::iterator it;
+    for(it = mStreams.begin(); it != mStreams.end(); ++it)
     {
-        mSocket.close();
-        throw std::runtime_error("Could not read from socket!");
+        mStream = it->second;
+        push(DISCONNECTED);
     }
+    mStreams.clear();
+
+    // The rest follows once the writer frees some messages
+    if (!flush())
+        retry();
+}
+
+void Connection::read_type()
+{
+    if (mClosed)
+        return;
+
+    // Pause reading while the writers are behind, or while control
+    // messages read before still wait for them
+    if (flush() && mMsg == NULL && IngestQueue::in_flight() < INGEST_BUDGET)
+        mMsg = mServer->mQueue.try_acquire();
+
+    if (mMsg == NULL)
+        return retry();
+
+    mBuffer.resize(sizeof(int));
+    async_read(mSocket, buffer(mBuffer), boost::bind(&Connection::on_type,
+                                                     shared_from_this(),
+                                                     placeholders::error));
+}
+
+void Connection::on_retry(const error_code& error, Stage resume)
+{
+    if (error)
+        return;
     
-    return type;
+    if (!mClosed)
+        (this->*resume)();
+    else if (!flush())
+        retry();
+}
+
+void Connection::retry(Stage resume)
+{
+    mRetry.expires_from_now(boost::posix_time::milliseconds(1));
+    mRetry.async_wait(boost::bind(&Connection::on_retry,
+                                  shared_from_this(),
+                                  placeholders::error,
+                                  resume));
 }
 
-DataHeader Server::listenHeader()
+void Connection::on_type(const error_code& error)
 {
-    DataHeader dh;
+    if (mClosed)
+        return;
+    if (error)
+        return disconnected();
+
+    int type;
+    const char* ptr = &mBuffer[0];
+    take(ptr, type);
+
+    switch (type)
+    {
+        case 0: // Open a new image
+        {
+            // Every image of a stream is a stream of its own for the
+            // writer, the last one is gone
+            if (mMultiplexed)
+            {
+                if (mStreams.count(mClientStream) > 0)
+                {
+                    mStream = mStreams[mClientStream];
+                    push(DISCONNECTED);
+                }
+                mStream = mStreams[mClientStream] = mServer->mNextStream++;
+            }
+            else
+            {
+                // Send back an image id
+                int image_id = 1;
+                error_code ec;
+                write(mSocket, buffer(reinterpret_cast<char*>(&image_id), sizeof(int)), ec);
+                if (ec)
+                    return disconnected();
+            }
+
+            read_header();
+            break;
+        }
+        case 1: // Write image data
+        case 5: // Write a preview of it
+        case 6: // Write it downsampled
+        {
+            // The stream has to have an image open
+            if (mMultiplexed && mStreams.count(mClientStream) == 0)
+                return disconnected();
+            
+            mType = type;
+            mBuffer.resize(PIXELS_INFO_SIZE);
+            async_read(mSocket, buffer(mBuffer), boost::bind(&Connection::on_pixels_info,
+                                                             shared_from_this(),
+                                                             placeholders::error));
+            break;
+        }
+        case 2: // Close image
+        {
+            // The other streams go on
+            if (mMultiplexed)
+            {
+                if (mStreams.count(mClientStream) == 0)
+                    return disconnected();
+                
+                // Without a free message the disconnect is held back,
+                // reading goes on from the retry timer once it's out
+                push(2);
+                push(DISCONNECTED);
+                mStreams.erase(mClientStream);
+                read_type();
+                break;
+            }
+            
+            push(2);
+            disconnected();
+            break;
+        }
+        case 8: // The next messages belong to another stream
+        {
+            mBuffer.resize(sizeof(int));
+            async_read(mSocket, buffer(mBuffer), boost::bind(&Connection::on_stream,
+                                                             shared_from_this(),
+                                                             placeholders::error));
+            break;
+        }
+        case 9: // When the parent process want to kill the listening thread
+        {
+            mServer->close();
+            break;
+        }
+        case 10: // Render statistics
+        {
+            if (mMultiplexed && mStreams.count(mClientStream) == 0)
+                return disconnected();
+            
+            mBuffer.resize(STATS_SIZE);
+            async_read(mSocket, buffer(mBuffer), boost::bind(&Connection::on_stats,
+                                                             shared_from_this(),
+                                                             placeholders::error));
+            break;
+        }
+        default:
+            disconnected();
+    }
+}
 
-    // Send back an image id
-    int image_id = 1;
-    write(mSocket, buffer(reinterpret_cast<char*>(&image_id), sizeof(int)));
+void Connection::read_header()
+{
+    if (mClosed)
+        return;
+    
+    // The last image of the stream took the message with its
+    // disconnect, the header waits for a free one
+    if (mMsg == NULL)
+        mMsg = mServer->mQueue.try_acquire();
+    
+    if (mMsg == NULL)
+        return retry(&Connection::read_header);
+    
+    mBuffer.resize(HEADER_SIZE);
+    async_read(mSocket, buffer(mBuffer), boost::bind(&Connection::on_header,
+                                                     shared_from_this(),
+                                                     placeholders::error));
+}
+
+void Connection::on_stream(const error_code& error)
+{
+    if (mClosed)
+        return;
+    if (error)
+        return disconnected();
     
-    // Read data from the buffer
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mSession), sizeof(long long)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mXres), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mYres), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mPixAspectRatio), sizeof(float)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mRArea), sizeof(long long)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mVersion), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mFrame), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mCamFov), sizeof(float)));
+    const char* ptr = &mBuffer[0];
+    take(ptr, mClientStream);
+    mMultiplexed = true;
     
+    std::map<int, int>::iterator it = mStreams.find(mClientStream);
+    mStream = it != mStreams.end() ? it->second : 0;
+    read_type();
+}
+
+void Connection::on_stats(const error_code& error)
+{
+    if (mClosed)
+        return;
+    if (error)
+        return disconnected();
+    
+    // Image id comes first
+    RenderStats& stats = mMsg->stats;
+    const char* ptr = &mBuffer[0] + sizeof(int);
+    take(ptr, stats.mIteration);
+    take(ptr, stats.mRam);
+    take(ptr, stats.mPeakRam);
+    take(ptr, stats.mTime);
+    take(ptr, stats.mBuckets);
+    
+    push(10);
+    read_type();
+}
+
+void Connection::on_header(const error_code& error)
+{
+    if (mClosed)
+        return;
+    if (error)
+        return disconnected();
+
+    DataHeader& dh = mMsg->header;
+    const char* ptr = &mBuffer[0];
+    take(ptr, dh.mSession);
+    take(ptr, dh.mXres);
+    take(ptr, dh.mYres);
+    take(ptr, dh.mPixAspectRatio);
+    take(ptr, dh.mRArea);
+    take(ptr, dh.mVersion);
+    take(ptr, dh.mFrame);
+    take(ptr, dh.mCamFov);
+
     const int camMatrixSize = 16;
     dh.mCamMatrixStore.resize(camMatrixSize);
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mCamMatrixStore[0]), sizeof(float)*camMatrixSize));
+    memcpy(&dh.mCamMatrixStore[0], ptr, sizeof(float) * camMatrixSize);
+    ptr += sizeof(float) * camMatrixSize;
 
     const int samplesSize = 6;
     dh.mSamplesStore.resize(samplesSize);
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mSamplesStore[0]), sizeof(int)*samplesSize));
-    
-    // Get output size
-    size_t output_size;
-    read(mSocket, buffer(reinterpret_cast<char*>(&output_size), sizeof(size_t)));
+    memcpy(&dh.mSamplesStore[0], ptr, sizeof(int) * samplesSize);
+    ptr += sizeof(int) * samplesSize;
+
+    const int dataWindowSize = 4;
+    memcpy(dh.mDataWindow, ptr, sizeof(int) * dataWindowSize);
+    ptr += sizeof(int) * dataWindowSize;
     
-    // Get output name
-    char* output_name = new char[output_size];
-    read(mSocket, buffer(output_name, output_size));
-    dh.mOutputName = output_name;
+    take(ptr, dh.mSource);
+    take(ptr, dh.mIteration);
 
-    return dh;
+    // Get output name
+    take(ptr, mNameSize);
+    mBuffer.resize(mNameSize);
+    async_read(mSocket, buffer(mBuffer), boost::bind(&Connection::on_output_name,
+                                                     shared_from_this(),
+                                                     placeholders::error));
 }
 
-DataPixels Server::listenPixels()
+void Connection::on_output_name(const error_code& error)
 {
-    DataPixels dp;
+    if (mClosed)
+        return;
+    if (error)
+        return disconnected();
+
+    char* output_name = new char[mNameSize];
+    memcpy(output_name, &mBuffer[0], mNameSize);
+    mMsg->header.mOutputName = output_name;
+
+    push(0);
     
-    // Receive image id
-    int image_id;
-    read(mSocket, buffer(reinterpret_cast<char*>(&image_id), sizeof(int)) );
+    // The Client only reads back once the image is open
+    mOpen = true;
+    if (!mServer->mRegion.empty())
+        send_region(mServer->mRegion);
+    if (mServer->mSubscription != AovSubscription())
+        send_subscription(mServer->mSubscription);
+    if (mServer->mControl != RENDER_RUN)
+        send_control(mServer->mControl);
+    
+    read_type();
+}
 
-    // Read data from the buffer
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mXres), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mYres), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mBucket_xo), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mBucket_yo), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mBucket_size_x), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mBucket_size_y), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mSpp), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mRam), sizeof(long long)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mTime), sizeof(int)));
+void Connection::on_pixels_info(const error_code& error)
+{
+    if (mClosed)
+        return;
+    if (error)
+        return disconnected();
 
-    // Get aov name's size
-    size_t aov_size;
-    read(mSocket, buffer(reinterpret_cast<char*>(&aov_size), sizeof(size_t)));
+    // Image id comes first
+    DataPixels& dp = mMsg->pixels;
+    const char* ptr = &mBuffer[0] + sizeof(int);
+    take(ptr, dp.mIteration);
+    take(ptr, dp.mXres);
+    take(ptr, dp.mYres);
+    take(ptr, dp.mBucket_xo);
+    take(ptr, dp.mBucket_yo);
+    take(ptr, dp.mBucket_size_x);
+    take(ptr, dp.mBucket_size_y);
+    take(ptr, dp.mSpp);
+    dp.mPreview = mType != 1;
+    dp.mScale = 1;
 
     // Get aov name
-    char* aov_name = new char[aov_size];
-    read(mSocket, buffer(aov_name, aov_size));
+    take(ptr, mNameSize);
+    mBuffer.resize(mNameSize);
+    async_read(mSocket, buffer(mBuffer), boost::bind(&Connection::on_aov_name,
+                                                     shared_from_this(),
+                                                     placeholders::error));
+}
+
+void Connection::on_aov_name(const error_code& error)
+{
+    if (mClosed)
+        return;
+    if (error)
+        return disconnected();
+
+    DataPixels& dp = mMsg->pixels;
+    char* aov_name = new char[mNameSize];
+    memcpy(aov_name, &mBuffer[0], mNameSize);
     dp.mAovName = aov_name;
 
-    // Get pixels
+    // Downsampled buckets tell their scale first
+    if (mType == 6)
+    {
+        mBuffer.resize(sizeof(int));
+        async_read(mSocket, buffer(mBuffer), boost::bind(&Connection::on_scale,
+                                                         shared_from_this(),
+                                                         placeholders::error));
+        return;
+    }
+    
+    read_pixels();
+}
+
+void Connection::on_scale(const error_code& error)
+{
+    if (mClosed)
+        return;
+    if (error)
+        return disconnected();
+    
+    DataPixels& dp = mMsg->pixels;
+    const char* ptr = &mBuffer[0];
+    take(ptr, dp.mScale);
+    if (dp.mScale < 1)
+        return disconnected();
+    
+    read_pixels();
+}
+
+void Connection::read_pixels()
+{
+    // Get pixels, straight into the message
+    DataPixels& dp = mMsg->pixels;
     const int num_samples = dp.bucket_size_x() * dp.bucket_size_y() * dp.spp();
     dp.mPixelStore.resize(num_samples);
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mPixelStore[0]), sizeof(float)*num_samples));
-    return dp;
+    if (num_samples <= 0)
+        return on_pixels(error_code());
+    
+    switch (mType)
+    {
+        case 5: // Previews are decoded once read
+        {
+            mBuffer.resize(num_samples);
+            async_read(mSocket, buffer(mBuffer), boost::bind(&Connection::on_preview,
+                                                             shared_from_this(),
+                                                             placeholders::error));
+            break;
+        }
+        case 6: // Downsampled ones are upscaled
+        {
+            const int& scale = dp.mScale;
+            const int w = (dp.bucket_size_x() + scale - 1) / scale;
+            const int h = (dp.bucket_size_y() + scale - 1) / scale;
+            mReduced.resize(w * h * dp.spp());
+            async_read(mSocket, buffer(mReduced), boost::bind(&Connection::on_scaled,
+                                                              shared_from_this(),
+                                                              placeholders::error));
+            break;
+        }
+        default:
+            async_read(mSocket, buffer(reinterpret_cast<char*>(&dp.mPixelStore[0]),
+                                       sizeof(float) * num_samples),
+                       boost::bind(&Connection::on_pixels,
+                                   shared_from_this(),
+                                   placeholders::error));
+    }
+}
+
+void Connection::on_preview(const error_code& error)
+{
+    if (mClosed)
+        return;
+    if (error)
+        return disconnected();
+    
+    std::vector<float>& pixels = mMsg->pixels.mPixelStore;
+    for (size_t i = 0; i < pixels.size(); ++i)
+        pixels[i] = decode_preview(static_cast<unsigned char>(mBuffer[i]));
+    
+    on_pixels(error);
+}
+
+void Connection::on_scaled(const error_code& error)
+{
+    if (mClosed)
+        return;
+    if (error)
+        return disconnected();
+    
+    // Every sample covers scale x scale pixels of the bucket
+    DataPixels& dp = mMsg->pixels;
+    const int& scale = dp.mScale;
+    const int& width = dp.mBucket_size_x;
+    const int& height = dp.mBucket_size_y;
+    const int& spp = dp.mSpp;
+    const int w = (width + scale - 1) / scale;
+    
+    float* dst = &dp.mPixelStore[0];
+    for (int y = 0; y < height; ++y)
+    {
+        const float* row = &mReduced[(y / scale) * w * spp];
+        for (int x = 0; x < width; ++x, dst += spp)
+            std::copy(row + (x / scale) * spp, row + (x / scale + 1) * spp, dst);
+    }
+    
+    on_pixels(error);
+}
+
+void Connection::on_pixels(const error_code& error)
+{
+    if (mClosed)
+        return;
+    if (error)
+        return disconnected();
+
+    mMsg->bytes = mMsg->pixels.mPixelStore.size() * sizeof(float);
+    push(1);
+    read_type();
+}
+
+void Connection::push(const int& type)
+{
+    // Control messages can't be dropped, but the io thread reads for
+    // every node and can't wait for one writer. Without a free message
+    // they're held back in order and flushed from the retry timer.
+    if (mMsg == NULL && !pending())
+        mMsg = mServer->mQueue.try_acquire();
+
+    if (mMsg == NULL)
+    {
+        mPending.push_back(std::make_pair(type, mStream));
+        return;
+    }
+
+    mMsg->type = type;
+    mMsg->stream = mStream;
+    mServer->mQueue.push(mMsg);
+    mMsg = NULL;
+}
+
+bool Connection::flush()
+{
+    while (pending())
+    {
+        if (mMsg == NULL)
+            mMsg = mServer->mQueue.try_acquire();
+        if (mMsg == NULL)
+            return false;
+
+        mMsg->type = mPending.front().first;
+        mMsg->stream = mPending.front().second;
+        mServer->mQueue.push(mMsg);
+        mMsg = NULL;
+        mPending.pop_front();
+    }
+    return true;
+}
+
+void Connection::send_region(const ViewRegion& region)
+{
+    mRegion = region;
+    mRegionPending = true;
+    if (mOpen && !mWriting && !mClosed)
+        write_next();
+}
+
+void Connection::send_subscription(const AovSubscription& subscription)
+{
+    mSubscription = subscription;
+    mSubscriptionPending = true;
+    if (mOpen && !mWriting && !mClosed)
+        write_next();
 }
 
+void Connection::send_control(const RenderControl& control)
+{
+    // An abort isn't undone by a later pause or resume
+    if (control == RENDER_ABORT)
+        mAbortPending = true;
+    else
+    {
+        mControl = control;
+        mControlPending = true;
+    }
+    if (mOpen && !mWriting && !mClosed)
+        write_next();
+}
+
+// Append the next field to the write buffer
+template <typename T>
+static void give(std::vector<char>& out, const T& value)
+{
+    const char* ptr = reinterpret_cast<const char*>(&value);
+    out.insert(out.end(), ptr, ptr + sizeof(T));
+}
+
+void Connection::write_next()
+{
+    mOutBuffer.clear();
+    if (mAbortPending)
+    {
+        give(mOutBuffer, 7);
+        give(mOutBuffer, static_cast<int>(RENDER_ABORT));
+        mAbortPending = false;
+    }
+    else if (mControlPending)
+    {
+        give(mOutBuffer, 7);
+        give(mOutBuffer, static_cast<int>(mControl));
+        mControlPending = false;
+    }
+    else if (mRegionPending)
+    {
+        give(mOutBuffer, 3);
+        give(mOutBuffer, mRegion.mMinX);
+        give(mOutBuffer, mRegion.mMinY);
+        give(mOutBuffer, mRegion.mMaxX);
+        give(mOutBuffer, mRegion.mMaxY);
+        give(mOutBuffer, mRegion.mZoom);
+        mRegionPending = false;
+    }
+    else if (mSubscriptionPending)
+    {
+        const std::vector<std::string>& viewed = mSubscription.mViewed;
+        give(mOutBuffer, 4);
+        give(mOutBuffer, static_cast<int>(mSubscription.mAll));
+        give(mOutBuffer, static_cast<int>(viewed.size()));
+        for (size_t i = 0; i < viewed.size(); ++i)
+        {
+            give(mOutBuffer, viewed[i].size());
+            mOutBuffer.insert(mOutBuffer.end(), viewed[i].begin(), viewed[i].end());
+        }
+        mSubscriptionPending = false;
+    }
+    else
+        return;
+    
+    mWriting = true;
+    async_write(mSocket, buffer(mOutBuffer), boost::bind(&Connection::on_write,
+                                                         shared_from_this(),
+                                                         placeholders::error));
+}
+
+void Connection::on_write(const error_code& error)
+{
+    mWriting = false;
+    
+    // Failures show up on the reading side
+    if (!error && !mClosed)
+        write_next();
+}
+
+void Connection::disconnected()
+{
+    close();
+    mServer->remove(shared_from_this());
+}
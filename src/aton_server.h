@@ -8,20 +8,130 @@ All rights reserved. See COPYING.txt for more details.
 #define ATON_SERVER_H_
 
 #include "aton_client.h"
+#include "aton_queue.h"
+#include <deque>
+#include <map>
+#include <set>
 #include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+
+class Server;
+
+// One Client connected to a Server. Several may be open at once,
+// each one tags what it reads with its own stream id so the writer
+// can tell the interleaved renders apart. A Client shared by several
+// renders tells which one the next messages belong to, and each of
+// their images gets a stream id of its own.
+class Connection: public boost::enable_shared_from_this<Connection>
+{
+public:
+    Connection(boost::shared_ptr<Server> server, const int& stream);
+
+    // Starts reading messages
+    void start();
+
+    // Closes the socket and lets the writer know the stream is gone
+    void close();
+    
+    // Tells the Client what the viewer is looking at
+    void send_region(const ViewRegion& region);
+    
+    // Tells the Client which AOVs to send
+    void send_subscription(const AovSubscription& subscription);
+    
+    // Tells the Client to pause, resume or abort the render
+    void send_control(const RenderControl& control);
+
+    boost::asio::ip::tcp::socket& socket() { return mSocket; }
+
+    // Whether control messages still wait for the writer
+    bool pending() const { return !mPending.empty(); }
+
+private:
+    typedef boost::system::error_code error_code;
+
+    // Reading stages of one message
+    typedef void (Connection::*Stage)();
+    void read_type();
+    void retry(Stage resume = &Connection::read_type);
+    void on_retry(const error_code& error, Stage resume);
+    void on_type(const error_code& error);
+    void read_header();
+    void on_stream(const error_code& error);
+    void on_stats(const error_code& error);
+    void on_header(const error_code& error);
+    void on_output_name(const error_code& error);
+    void on_pixels_info(const error_code& error);
+    void on_aov_name(const error_code& error);
+    void on_scale(const error_code& error);
+    void read_pixels();
+    void on_preview(const error_code& error);
+    void on_scaled(const error_code& error);
+    void on_pixels(const error_code& error);
+
+    // Publish the current message
+    void push(const int& type);
+    
+    // Publish the control messages waiting for a free message,
+    // false if some still have to wait
+    bool flush();
+    
+    // Writing back to the Client, one message at a time
+    void write_next();
+    void on_write(const error_code& error);
+
+    // Connection is gone, close and leave the server
+    void disconnected();
+
+    boost::shared_ptr<Server> mServer;
+    int mStream;
+    bool mClosed;
+    
+    // Streams of the Client and the stream ids of their open images,
+    // and the one being read
+    bool mMultiplexed;
+    std::map<int, int> mStreams;
+    int mClientStream;
+
+    // Control messages waiting for a free message, as type and stream
+    std::deque<std::pair<int, int> > mPending;
+
+    // Message being read, and the raw fields of it
+    IngestMessage* mMsg;
+    std::vector<char> mBuffer;
+    size_t mNameSize;
+    
+    // Pixel message type being read, and the samples of a downsampled one
+    int mType;
+    std::vector<float> mReduced;
+    
+    // Latest messages for the Client, and the one being written
+    ViewRegion mRegion;
+    AovSubscription mSubscription;
+    std::vector<char> mOutBuffer;
+    bool mOpen, mWriting, mRegionPending, mSubscriptionPending;
+    RenderControl mControl;
+    bool mControlPending, mAbortPending;
+
+    // TCP stuff
+    boost::asio::ip::tcp::socket mSocket;
+    boost::asio::deadline_timer mRetry;
+};
 
  // Represents a listening Server, ready to accept incoming images
  // This class wraps up the provision of a TCP port, and handles incoming
- // connections from Client objects when they're ready to send image data
-class Server
+ // connections from Client objects when they're ready to send image data.
+ // Everything but connect() runs asynchronously on the io_service of the
+ // IngestService, read messages are pushed to the queue of the node.
+class Server: public boost::enable_shared_from_this<Server>
 {
+    friend class Connection;
 public:
     // Creates a new server. By default the Server is not connected at creation time
-    Server();
-    
-    // Creates a new server and calls connect() with the specified port number
-    Server(int port);
-    
+    Server(boost::asio::io_service& io_service, IngestQueue& queue);
+
     // Shuts down the server, closing any open ports if the server is connected
     ~Server();
 
@@ -30,35 +140,92 @@ public:
     // available. To find out which port the server managed to connect to,
     // call get_port() afterwards
     void connect(int port, bool search=false);
-    
-    // Sets up the server to accept an incoming Client connections.
-    void accept();
 
-    // This function blocks (and so may be require running on a separate thread),
-    // returning once a Client has sent a message.
-    // The returned Data object is filled with the relevant information and
-    // passed back ready for handling by the parent application
-    int listen_type();
-    DataHeader listenHeader();
-    DataPixels listenPixels();
-    
-    // This can be used to exit a listening loop running on a separate thread
-    void quit();
+    // Starts accepting incoming Client connections
+    void start();
+
+    // Closes the port and the open connections, and tells the
+    // writer to quit once everything read before is queued
+    void close();
 
     // Returns whether or not the server is connected to a port
-    bool connected() { return mAcceptor.is_open(); }
+    bool connected() const { return mPort != 0 && !mClosed; }
 
     //! Returns the port the server is currently connected to
     int get_port() { return mPort; }
+    
+    // Passes the region the viewer is looking at on to the Clients
+    void set_region(const ViewRegion& region);
+    
+    // Passes the AOVs the node wants on to the Clients
+    void set_subscription(const AovSubscription& subscription);
+    
+    // Holds the renders back, or lets them run again
+    void set_paused(const bool& paused);
+    
+    // Ends the current iteration of the renders
+    void abort();
+    
+    // Pauses the renders once the live image wasn't looked at for
+    // this many seconds, 0 never does
+    void set_auto_pause(const double& seconds);
+    
+    // The live image is being looked at, resumes an auto paused render
+    void keep_alive();
 
 private:
+    typedef boost::system::error_code error_code;
+
+    void accept();
+    void on_accept(boost::shared_ptr<Connection> connection, const error_code& error);
+
+    // Connection closed, drop it
+    void remove(boost::shared_ptr<Connection> connection);
+    
+    // Tells the writer to quit once the closed connections are flushed
+    void push_quit();
+    void on_quit(const error_code& error);
+    
+    // Checks once a second whether the live image went unseen
+    void wait_idle();
+    void on_idle(const error_code& error);
+    
+    // Pause or run, passed on to the Clients when it changes
+    RenderControl control() const;
+    void update_control();
+
     // Port we're listening to
     int mPort;
+
+    // Queue of the node we're reading for
+    IngestQueue& mQueue;
+
+    boost::atomic<bool> mClosed;
+
+    // Open connections and the id of the next one
+    std::set<boost::shared_ptr<Connection> > mConnections;
+    int mNextStream;
+    
+    // Closed connections still flushing, the writer quits after them
+    std::set<boost::shared_ptr<Connection> > mClosing;
     
+    // Region the viewer is looking at and the AOVs it wants,
+    // sent to every Client opening
+    ViewRegion mRegion;
+    AovSubscription mSubscription;
+    
+    // Paused by the node, or for nobody looking at the live image
+    // since mLastView, and what the Clients were told last
+    bool mPaused, mIdle;
+    double mAutoPause;
+    boost::posix_time::ptime mLastView;
+    RenderControl mControl;
+
     // TCP stuff
-    boost::asio::io_service mIoService;
-    boost::asio::ip::tcp::socket mSocket;
+    boost::asio::io_service& mIoService;
     boost::asio::ip::tcp::acceptor mAcceptor;
+    boost::asio::deadline_timer mIdleTimer;
+    boost::asio::deadline_timer mRetry;
 };
 
 #endif // ATON_SERVER_H_
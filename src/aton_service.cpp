@@ -0,0 +1,132 @@
+/*
+Copyright (c) 2018,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_service.h"
+#include <boost/bind.hpp>
+
+IngestService::IngestService(): _focus(NULL) {}
+
+IngestService& IngestService::instance()
+{
+    // Never destroyed, the threads may outlive static destruction
+    static IngestService* service = new IngestService();
+    return *service;
+}
+
+int IngestService::subscribe(const int& port, const bool& search, IngestQueue& queue)
+{
+    Guard guard(_lock);
+
+    boost::shared_ptr<Server> server(new Server(_io_service, queue));
+    server->connect(port, search);
+
+    // First one in starts the threads, once the last one out
+    // is done joining the old reading thread
+    if (!_work)
+    {
+        Guard join(_join_lock);
+        _io_service.reset();
+        _work.reset(new boost::asio::io_service::work(_io_service));
+        Thread::spawn(io_thread, 1, this);
+        _pool.start();
+    }
+
+    const int bound = server->get_port();
+    _servers[bound] = server;
+    _io_service.post(boost::bind(&Server::start, server));
+    return bound;
+}
+
+void IngestService::unsubscribe(const int& port)
+{
+    {
+        Guard guard(_lock);
+
+        std::map<int, boost::shared_ptr<Server> >::iterator it = _servers.find(port);
+        if (it == _servers.end())
+            return;
+
+        _io_service.post(boost::bind(&Server::close, it->second));
+        _servers.erase(it);
+
+        if (!_servers.empty())
+            return;
+
+        _work.reset();
+        _join_lock.lock();
+    }
+
+    // Last one out joins the reading thread, the pool is kept
+    // since the writers may still be finishing their batches.
+    // The reading may wait for the writers to take the last
+    // messages, the other nodes aren't held up meanwhile.
+    Thread::wait(this);
+    _join_lock.unlock();
+}
+
+bool IngestService::connected(const int& port)
+{
+    Guard guard(_lock);
+
+    std::map<int, boost::shared_ptr<Server> >::iterator it = _servers.find(port);
+    return it != _servers.end() && it->second->connected();
+}
+
+void IngestService::set_region(const int& port, const ViewRegion& region)
+{
+    Guard guard(_lock);
+    
+    std::map<int, boost::shared_ptr<Server> >::iterator it = _servers.find(port);
+    if (it != _servers.end())
+        _io_service.post(boost::bind(&Server::set_region, it->second, region));
+}
+
+void IngestService::set_subscription(const int& port, const AovSubscription& subscription)
+{
+    Guard guard(_lock);
+    
+    std::map<int, boost::shared_ptr<Server> >::iterator it = _servers.find(port);
+    if (it != _servers.end())
+        _io_service.post(boost::bind(&Server::set_subscription, it->second, subscription));
+}
+
+void IngestService::set_control(const int& port, const RenderControl& control)
+{
+    Guard guard(_lock);
+    
+    std::map<int, boost::shared_ptr<Server> >::iterator it = _servers.find(port);
+    if (it == _servers.end())
+        return;
+    
+    if (control == RENDER_ABORT)
+        _io_service.post(boost::bind(&Server::abort, it->second));
+    else
+        _io_service.post(boost::bind(&Server::set_paused, it->second, control == RENDER_PAUSE));
+}
+
+void IngestService::set_auto_pause(const int& port, const double& seconds)
+{
+    Guard guard(_lock);
+    
+    std::map<int, boost::shared_ptr<Server> >::iterator it = _servers.find(port);
+    if (it != _servers.end())
+        _io_service.post(boost::bind(&Server::set_auto_pause, it->second, seconds));
+}
+
+void IngestService::keep_alive(const int& port)
+{
+    Guard guard(_lock);
+    
+    std::map<int, boost::shared_ptr<Server> >::iterator it = _servers.find(port);
+    if (it != _servers.end())
+        _io_service.post(boost::bind(&Server::keep_alive, it->second));
+}
+
+void IngestService::io_thread(unsigned index, unsigned nthreads, void* data)
+{
+    IngestService* service = reinterpret_cast<IngestService*>(data);
+    service->_io_service.run();
+}
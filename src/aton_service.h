@@ -0,0 +1,88 @@
+/*
+Copyright (c) 2018,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_SERVICE_H_
+#define ATON_SERVICE_H_
+
+#include <map>
+#include <DDImage/Thread.h>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include "aton_pool.h"
+#include "aton_queue.h"
+#include "aton_server.h"
+
+using namespace DD::Image;
+
+// Network ingest shared by all the Aton nodes of the process.
+// One thread reads every listening port asynchronously and hands
+// the messages to the queue of the subscribed node, and one pool
+// applies the batches of all the nodes' writers, serving the node
+// being viewed first. The reading pauses once the queued pixels
+// of all the nodes together exceed INGEST_BUDGET.
+class IngestService
+{
+public:
+    // Lives as long as the process
+    static IngestService& instance();
+
+    // Listen on the port, or the first free one after it if search
+    // is set, and queue what's read to the queue. Returns the port,
+    // throws if none could be bound.
+    int subscribe(const int& port, const bool& search, IngestQueue& queue);
+
+    // Stop listening, the queue is sent a quit message last
+    void unsubscribe(const int& port);
+
+    // Whether the port is still listened to
+    bool connected(const int& port);
+    
+    // Region the viewer of the node on the port is looking at,
+    // passed on to the renders so what's in view comes first
+    void set_region(const int& port, const ViewRegion& region);
+    
+    // AOVs the node on the port wants the renders to send
+    void set_subscription(const int& port, const AovSubscription& subscription);
+    
+    // Pauses, resumes or aborts the renders sending to the port
+    void set_control(const int& port, const RenderControl& control);
+    
+    // Seconds the live image of the node on the port may go
+    // unseen before its renders are paused, 0 never pauses them
+    void set_auto_pause(const int& port, const double& seconds);
+    
+    // The node on the port is looking at its live image
+    void keep_alive(const int& port);
+
+    // Pool shared by the writers
+    WorkerPool& pool() { return _pool; }
+
+    // Node whose batches are applied first
+    void set_focus(const void* node) { _focus = node; }
+    bool has_focus(const void* node) const { return _focus == node; }
+
+private:
+    IngestService();
+
+    static void io_thread(unsigned index, unsigned nthreads, void* data);
+
+    // Servers by port, guarded by _lock
+    std::map<int, boost::shared_ptr<Server> > _servers;
+    Lock _lock;
+    
+    // Held while the last one out joins the reading thread
+    Lock _join_lock;
+
+    boost::asio::io_service _io_service;
+    boost::scoped_ptr<boost::asio::io_service::work> _work;
+
+    WorkerPool _pool;
+    boost::atomic<const void*> _focus;
+};
+
+#endif // ATON_SERVICE_H_